@@ -0,0 +1,90 @@
+/*
+ * Scratch memory for formatting entries.
+ * A bump allocator: the formatters take their temporary buffers from the
+ * current block and the whole arena is reset once a directory is printed,
+ * so printing an entry does no malloc or free. Blocks that were added
+ * because the first one filled up are freed on reset; the block kept is
+ * the largest one, so a directory of long names only grows it once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ls.h"
+
+#define ARENA_INITIAL_SIZE (16 * 1024)
+// every allocation starts on this boundary; data is aligned to it as
+// well, the header alone would leave it at 24
+#define ARENA_ALIGN 16
+
+struct block {
+	struct block *next;
+	size_t size;
+	size_t used;
+	_Alignas(ARENA_ALIGN) char data[];
+};
+
+static struct block *current;
+
+unsigned long arenaAllocs;	// counted in make debug builds only
+unsigned long arenaBlocks;
+
+static void 
+newBlock(size_t need)
+{
+	struct block *b;
+	size_t size;
+
+	size = (current == NULL) ? ARENA_INITIAL_SIZE : current->size * 2;
+	while (size < need) {
+		size *= 2;
+	}
+
+	if ((b = malloc(sizeof(struct block) + size)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	b->next = current;
+	b->size = size;
+	b->used = 0;
+	current = b;
+	arenaBlocks++;
+}
+
+// memory is valid until the next resetArena()
+void *
+arenaAlloc(size_t size)
+{
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (current == NULL || current->size - current->used < size) {
+		newBlock(size);
+	}
+
+	p = current->data + current->used;
+	current->used += size;
+#ifdef LS_DEBUG
+	arenaAllocs++;
+#endif
+
+	return p;
+}
+
+void 
+resetArena()
+{
+	struct block *b;
+
+	if (current == NULL) {
+		return;
+	}
+
+	while ((b = current->next) != NULL) {
+		current->next = b->next;
+		free(b);
+	}
+
+	current->used = 0;
+}
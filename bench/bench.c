@@ -0,0 +1,344 @@
+/*
+ * Benchmark harness.
+ * usage: bench ls dir [runs]
+ * Runs ls with the usual flags on the trees gentree made in dir, with the
+ * output going to /dev/null, and prints per case:
+ *   wall   minimum and median wall clock time of the runs
+ *   cpu    median user + system time, more than wall when -R uses threads
+ *   rss    peak resident set size of all runs
+ *   the system calls of one more run, traced with ptrace (all threads):
+ *   in total, then open, getdents, stat, readlink, write, io_uring and
+ *   everything else. Stats done through io_uring are not system calls;
+ *   they show as io_uring_enter calls.
+ * The environment is passed on, so LS_THREADS, LS_NO_URING and the other
+ * knobs can be compared.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_RUNS 100
+
+#define CAT_OPEN 0
+#define CAT_GETDENTS 1
+#define CAT_STAT 2
+#define CAT_READLINK 3
+#define CAT_WRITE 4
+#define CAT_URING 5
+#define CAT_OTHER 6
+#define CAT_COUNT 7
+
+struct benchcase {
+	const char *tree;
+	const char *flags;
+};
+
+static const struct benchcase cases[] = {
+	{"flat10k", "-1"},
+	{"flat10k", "-l"},
+	{"flat10k", "-lt"},
+	{"flat10k", "-S"},
+	{"flat10k", "-C"},
+	{"flat10k", "-f"},
+	{"flat1m", "-1"},
+	{"flat1m", "-l"},
+	{"flat1m", "-lt"},
+	{"flat1m", "-S"},
+	{"flat1m", "-C"},
+	{"flat1m", "-f"},
+	{"deep", "-lR"},
+	{"deeplinks", "-lR"},
+	{"wide", "-lR"},
+	{"wide", "-fR"},
+	{"symlinks", "-l"},
+	{"symlinks", "-C"},
+	{"escape", "-1"},
+	{"escape", "-q"},
+	{"escape", "-C"},
+};
+
+static const char *catNames[CAT_COUNT] = {
+	"open", "getdents", "stat", "readlink", "write", "uring", "other"
+};
+
+static int 
+category(unsigned long nr)
+{
+	switch (nr) {
+#ifdef SYS_open
+	case SYS_open:
+#endif
+	case SYS_openat:
+		return CAT_OPEN;
+	case SYS_getdents64:
+		return CAT_GETDENTS;
+	case SYS_statx:
+	case SYS_fstat:
+#ifdef SYS_newfstatat
+	case SYS_newfstatat:
+#endif
+#ifdef SYS_stat
+	case SYS_stat:
+	case SYS_lstat:
+#endif
+		return CAT_STAT;
+#ifdef SYS_readlink
+	case SYS_readlink:
+#endif
+	case SYS_readlinkat:
+		return CAT_READLINK;
+	case SYS_write:
+	case SYS_writev:
+		return CAT_WRITE;
+	case SYS_io_uring_setup:
+	case SYS_io_uring_enter:
+	case SYS_io_uring_register:
+		return CAT_URING;
+	default:
+		return CAT_OTHER;
+	}
+}
+
+static double 
+elapsedMs(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static int 
+cmpDouble(const void *a, const void *b)
+{
+	double x, y;
+
+	x = *(const double *) a;
+	y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+// in the child: output to /dev/null, then exec ls
+static void 
+execLs(char **args)
+{
+	int fd;
+
+	if ((fd = open("/dev/null", O_WRONLY)) == -1) {
+		perror("/dev/null");
+		_exit(127);
+	}
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+
+	execv(args[0], args);
+	perror(args[0]);
+	_exit(127);
+}
+
+static pid_t 
+spawn(char **args, int traced)
+{
+	pid_t pid;
+
+	if ((pid = fork()) == -1) {
+		perror("fork");
+		exit(1);
+	}
+
+	if (pid == 0) {
+		if (traced && ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
+			perror("ptrace");
+			_exit(127);
+		}
+		execLs(args);
+	}
+
+	return pid;
+}
+
+static int 
+checkStatus(int status)
+{
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		return 0;
+	}
+
+	if (WIFSIGNALED(status)) {
+		fprintf(stderr, "bench: ls killed by signal %d\n", WTERMSIG(status));
+	} else {
+		fprintf(stderr, "bench: ls exited with %d\n", WEXITSTATUS(status));
+	}
+
+	return -1;
+}
+
+// one untraced run; returns -1 if ls failed
+static int 
+timedRun(char **args, double *wall, double *cpu, long *rss)
+{
+	struct timespec start, end;
+	struct rusage ru;
+	pid_t pid;
+	int status;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = spawn(args, 0);
+	if (wait4(pid, &status, 0, &ru) == -1) {
+		perror("wait4");
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*wall = elapsedMs(&start, &end);
+	*cpu = ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3 + ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+	*rss = ru.ru_maxrss;
+
+	return checkStatus(status);
+}
+
+// one run under ptrace counting the system calls of every thread by
+// category; returns -1 if ls failed
+static int 
+tracedRun(char **args, unsigned long *counts)
+{
+	struct __ptrace_syscall_info info;
+	pid_t pid, tid;
+	int status, lsStatus, sig;
+
+	pid = spawn(args, 1);
+
+	// stopped at the exec
+	if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+		fprintf(stderr, "bench: cannot trace ls\n");
+		return checkStatus(status);
+	}
+	ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+	ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+	lsStatus = 0;
+	while ((tid = waitpid(-1, &status, __WALL)) != -1) {
+		if (!WIFSTOPPED(status)) {
+			if (tid == pid) {
+				lsStatus = status;
+			}
+			continue;
+		}
+
+		sig = WSTOPSIG(status);
+		if (sig == (SIGTRAP | 0x80)) {
+			if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+				counts[category(info.entry.nr)]++;
+			}
+			sig = 0;
+		} else if (sig == SIGTRAP || sig == SIGSTOP) {
+			// clone events, and the stop new threads start with
+			sig = 0;
+		}
+
+		ptrace(PTRACE_SYSCALL, tid, NULL, sig);
+	}
+
+	if (errno != ECHILD) {
+		perror("waitpid");
+		exit(1);
+	}
+
+	return checkStatus(lsStatus);
+}
+
+static void 
+printHeader()
+{
+	int i;
+
+	printf("%-10s %-5s %10s %10s %10s %10s %10s", "tree", "flags", "wall min", "wall med", "cpu med", "rss KB", "syscalls");
+	for (i = 0; i < CAT_COUNT; i++) {
+		printf(" %9s", catNames[i]);
+	}
+	printf("\n");
+}
+
+static void 
+runCase(const char *ls, const char *dir, const struct benchcase *bc, int runs)
+{
+	char path[4096];
+	char *args[4];
+	double walls[MAX_RUNS], cpus[MAX_RUNS];
+	unsigned long counts[CAT_COUNT], total;
+	long rss, peak;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, bc->tree);
+	args[0] = (char *) ls;
+	args[1] = (char *) bc->flags;
+	args[2] = path;
+	args[3] = NULL;
+
+	peak = 0;
+	for (i = 0; i < runs; i++) {
+		if (timedRun(args, &walls[i], &cpus[i], &rss) == -1) {
+			fprintf(stderr, "bench: %s %s failed\n", bc->flags, path);
+			return;
+		}
+		if (peak < rss) {
+			peak = rss;
+		}
+	}
+	qsort(walls, runs, sizeof(double), cmpDouble);
+	qsort(cpus, runs, sizeof(double), cmpDouble);
+
+	memset(counts, 0, sizeof(counts));
+	if (tracedRun(args, counts) == -1) {
+		fprintf(stderr, "bench: traced %s %s failed\n", bc->flags, path);
+		return;
+	}
+	total = 0;
+	for (i = 0; i < CAT_COUNT; i++) {
+		total += counts[i];
+	}
+
+	printf("%-10s %-5s %10.2f %10.2f %10.2f %10ld %10lu", bc->tree, bc->flags, walls[0], walls[runs / 2], cpus[runs / 2], peak, total);
+	for (i = 0; i < CAT_COUNT; i++) {
+		printf(" %9lu", counts[i]);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+int 
+main(int argc, char **argv)
+{
+	char *endptr;
+	long runs;
+	size_t i;
+
+	if (argc < 3 || argc > 4) {
+		fprintf(stderr, "usage: bench ls dir [runs]\n");
+		exit(1);
+	}
+
+	runs = 5;
+	if (argc == 4) {
+		runs = strtol(argv[3], &endptr, 10);
+		if (*endptr != '\0' || runs < 1 || runs > MAX_RUNS) {
+			fprintf(stderr, "bench: runs must be 1 to %d\n", MAX_RUNS);
+			exit(1);
+		}
+	}
+
+	printHeader();
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		runCase(argv[1], argv[2], &cases[i], runs);
+	}
+
+	return 0;
+}
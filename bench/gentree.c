@@ -0,0 +1,354 @@
+/*
+ * Synthetic trees for the benchmarks.
+ * usage: gentree dir [large]
+ * Creates under dir:
+ *   flat10k    10000 files
+ *   flat1m     large files, 1000000 by default
+ *   deep       a chain of 200 directories, a few files in each
+ *   deeplinks  a chain of 300 directories with long names, so the paths
+ *              at the bottom are longer than PATH_MAX, with a file and a
+ *              symlink to it in each
+ *   wide       50 x 50 directories of 20 files each
+ *   symlinks   2000 files and 8000 links to files, directories, links and
+ *              nothing
+ *   escape     10000 files whose names have control and non-ASCII bytes
+ * Names, sizes and times come from a fixed seed, so every run creates the
+ * same trees. A tree is built under a temporary name and renamed when it
+ * is complete; trees that exist already are left alone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define SEED 0x5eed1e55ULL
+
+// times are spread over the year before this one (2014-10-20)
+#define BASE_TIME 1413763200L
+#define TIME_SPAN (365L * 24 * 3600)
+
+static unsigned long long state;
+
+static unsigned int 
+nextRandom()
+{
+	// xorshift64*
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+
+	return (state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+static void 
+fail(const char *what, const char *path)
+{
+	fprintf(stderr, "gentree: %s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+// a name of at least 4 characters, unique through the index before the _
+static void 
+makeName(char *name, size_t size, const char *prefix, int index)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789_-.";
+	int len, i, n;
+
+	n = snprintf(name, size, "%s%d_", prefix, index);
+	len = 4 + nextRandom() % 25;
+	for (i = n; i < len && i < (int) size - 1; i++) {
+		name[i] = chars[nextRandom() % (sizeof(chars) - 1)];
+	}
+	name[i > n ? i : n] = '\0';
+}
+
+static void 
+randomTimes(struct timespec *times)
+{
+	times[0].tv_sec = BASE_TIME + nextRandom() % TIME_SPAN;
+	times[0].tv_nsec = nextRandom() % 1000000000;
+	times[1] = times[0];
+}
+
+static void 
+makeFile(int dirfd, const char *name)
+{
+	struct timespec times[2];
+	off_t size;
+	int fd;
+
+	if ((fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+		fail("open", name);
+	}
+
+	// mostly small files and a few large ones; sparse, so they cost no space
+	size = nextRandom() % 8192;
+	if (nextRandom() % 16 == 0) {
+		size *= 1 + nextRandom() % 100000;
+	}
+	if (ftruncate(fd, size) == -1) {
+		fail("ftruncate", name);
+	}
+
+	randomTimes(times);
+	if (futimens(fd, times) == -1) {
+		fail("futimens", name);
+	}
+
+	close(fd);
+}
+
+// directories get their times once they are filled
+static void 
+closeDir(int fd)
+{
+	struct timespec times[2];
+
+	randomTimes(times);
+	if (futimens(fd, times) == -1) {
+		fail("futimens", "directory");
+	}
+
+	close(fd);
+}
+
+static int 
+makeDir(int dirfd, const char *name)
+{
+	int fd;
+
+	if (mkdirat(dirfd, name, 0755) == -1) {
+		fail("mkdir", name);
+	}
+	if ((fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY)) == -1) {
+		fail("open", name);
+	}
+
+	return fd;
+}
+
+static void 
+makeFiles(int dirfd, const char *prefix, int count)
+{
+	char name[64];
+	int i;
+
+	for (i = 0; i < count; i++) {
+		makeName(name, sizeof(name), prefix, i);
+		makeFile(dirfd, name);
+	}
+}
+
+static void 
+genFlat(int fd, int count)
+{
+	makeFiles(fd, "f", count);
+}
+
+static void 
+genDeep(int fd, int unused)
+{
+	char name[64];
+	int depth, next;
+
+	fd = dup(fd);
+	for (depth = 0; depth < 200; depth++) {
+		makeFiles(fd, "f", 5);
+		snprintf(name, sizeof(name), "level%03d_%08x", depth, nextRandom());
+		next = makeDir(fd, name);
+		closeDir(fd);
+		fd = next;
+	}
+	closeDir(fd);
+}
+
+static void 
+genDeepLinks(int fd, int unused)
+{
+	char name[64];
+	int depth, next;
+
+	fd = dup(fd);
+	for (depth = 0; depth < 300; depth++) {
+		makeFiles(fd, "f", 1);
+		if (symlinkat("..", fd, "up") == -1) {
+			fail("symlink", "up");
+		}
+		snprintf(name, sizeof(name), "level%03d_%08x_%08x", depth, nextRandom(), nextRandom());
+		next = makeDir(fd, name);
+		closeDir(fd);
+		fd = next;
+	}
+	if (symlinkat("..", fd, "up") == -1) {
+		fail("symlink", "up");
+	}
+	closeDir(fd);
+}
+
+static void 
+genWide(int fd, int unused)
+{
+	char name[64];
+	int i, j, sub, subsub;
+
+	for (i = 0; i < 50; i++) {
+		snprintf(name, sizeof(name), "d%02d", i);
+		sub = makeDir(fd, name);
+		for (j = 0; j < 50; j++) {
+			snprintf(name, sizeof(name), "e%02d", j);
+			subsub = makeDir(sub, name);
+			makeFiles(subsub, "f", 20);
+			closeDir(subsub);
+		}
+		closeDir(sub);
+	}
+}
+
+static void 
+genSymlinks(int fd, int unused)
+{
+	struct timespec times[2];
+	char name[64], target[64];
+	int i, dir;
+
+	for (i = 0; i < 2000; i++) {
+		snprintf(name, sizeof(name), "f%d", i);
+		makeFile(fd, name);
+	}
+	for (i = 0; i < 10; i++) {
+		snprintf(name, sizeof(name), "dir%d", i);
+		dir = makeDir(fd, name);
+		makeFiles(dir, "f", 10);
+		closeDir(dir);
+	}
+
+	for (i = 0; i < 8000; i++) {
+		switch (nextRandom() % 4) {
+		case 0:
+			snprintf(target, sizeof(target), "dir%u", nextRandom() % 10);
+			break;
+		case 1:
+			snprintf(target, sizeof(target), "missing%d", i);
+			break;
+		case 2:
+			if (i > 0) {
+				snprintf(target, sizeof(target), "l%d", nextRandom() % i);
+				break;
+			}
+			// fall through
+		default:
+			snprintf(target, sizeof(target), "f%u", nextRandom() % 2000);
+			break;
+		}
+
+		snprintf(name, sizeof(name), "l%d", i);
+		if (symlinkat(target, fd, name) == -1) {
+			fail("symlink", name);
+		}
+		randomTimes(times);
+		if (utimensat(fd, name, times, AT_SYMLINK_NOFOLLOW) == -1) {
+			fail("utimensat", name);
+		}
+	}
+}
+
+static void 
+genEscape(int fd, int unused)
+{
+	char name[64];
+	int i, j, len;
+
+	for (i = 0; i < 10000; i++) {
+		len = snprintf(name, sizeof(name), "e%d_", i);
+		for (j = 0; j < 8 + (int) (nextRandom() % 24); j++) {
+			switch (nextRandom() % 8) {
+			case 0:
+				name[len++] = 1 + nextRandom() % 31;	// control
+				break;
+			case 1:
+				name[len++] = 127;
+				break;
+			case 2:
+				name[len++] = 0x80 + nextRandom() % 128;	// non-ASCII
+				break;
+			default:
+				name[len++] = 'a' + nextRandom() % 26;
+				break;
+			}
+		}
+		name[len] = '\0';
+		makeFile(fd, name);
+	}
+}
+
+// builds tree name in root with gen unless it is there already
+static void 
+generate(int root, const char *name, void (*gen)(int, int), int arg)
+{
+	char temp[64];
+	struct stat sb;
+	int fd;
+
+	if (fstatat(root, name, &sb, 0) == 0) {
+		printf("%s: exists\n", name);
+		return;
+	}
+
+	printf("%s: creating\n", name);
+	fflush(stdout);
+
+	snprintf(temp, sizeof(temp), "%s.tmp", name);
+	state = SEED;
+	fd = makeDir(root, temp);
+	gen(fd, arg);
+	closeDir(fd);
+
+	if (renameat(root, temp, root, name) == -1) {
+		fail("rename", temp);
+	}
+}
+
+int 
+main(int argc, char **argv)
+{
+	char *endptr;
+	long large;
+	int root;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: gentree dir [large]\n");
+		exit(1);
+	}
+
+	large = 1000000;
+	if (argc == 3) {
+		large = strtol(argv[2], &endptr, 10);
+		if (*endptr != '\0' || large <= 0) {
+			fprintf(stderr, "gentree: bad size %s\n", argv[2]);
+			exit(1);
+		}
+	}
+
+	if (mkdir(argv[1], 0755) == -1 && errno != EEXIST) {
+		fail("mkdir", argv[1]);
+	}
+	if ((root = open(argv[1], O_RDONLY | O_DIRECTORY)) == -1) {
+		fail("open", argv[1]);
+	}
+
+	generate(root, "flat10k", genFlat, 10000);
+	generate(root, "flat1m", genFlat, large);
+	generate(root, "deep", genDeep, 0);
+	generate(root, "deeplinks", genDeepLinks, 0);
+	generate(root, "wide", genWide, 0);
+	generate(root, "symlinks", genSymlinks, 0);
+	generate(root, "escape", genEscape, 0);
+
+	close(root);
+	return 0;
+}
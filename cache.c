@@ -0,0 +1,556 @@
+/*
+ * Persistent directory cache, enabled by naming its file in the LS_CACHE
+ * environment variable.
+ * The file holds, for each directory read, its entries with their d_type
+ * and stat, keyed by the device, inode, mtime and ctime of the directory.
+ * It is mapped read-only at start; readDirectory() looks a directory up
+ * after opening it and, if the directory has not changed since, copies
+ * the entries from the map instead of reading and stat'ing them.
+ * Changes to a file that do not touch its directory (a file growing, a
+ * chmod) are not seen in the directory, so only the entries that may have
+ * changed are stat'ed again, in one batch:
+ *   subdirectories, which change whenever their entries do
+ *   entries changed in the CACHE_HOT_AGE before they were stat'ed, files
+ *   that are being written are likely to be written again
+ *   all of them once the stats are LS_CACHE_MAX_AGE seconds old (default
+ *   CACHE_MAX_AGE)
+ * A file left alone for a while and then changed can so be listed with
+ * its old stat for up to LS_CACHE_MAX_AGE, which trades freshness for
+ * speed like LS_DONT_SYNC does.
+ * Directories read in this run are written, with the records that are
+ * still useful, to a new file that replaces the old one at exit; a run
+ * that only used records as they were leaves the file alone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <dirent.h>
+
+#include "ls.h"
+
+#define CACHE_MAGIC "LSCACHE3"
+
+// records not used for this long are dropped
+#define CACHE_MAX_IDLE (30L * 24 * 3600)
+
+// the last use of a record is written back once it is this old
+#define CACHE_USED_REFRESH (24L * 3600)
+
+// entries changed this long before they were stat'ed are stat'ed again
+#define CACHE_HOT_AGE 3600
+
+// all entries are stat'ed again once their stats are this old
+#define CACHE_MAX_AGE 3600
+
+// old record states
+#define REC_UNUSED 0
+#define REC_USED 1
+#define REC_REPLACED 2
+
+struct cachehead {
+	char magic[8];
+	uint32_t statSize;	// sizeof(struct stat) of the writer
+	uint32_t buckets;
+	uint64_t records;
+	uint64_t size;	// of the whole file
+};
+
+// followed by count struct cacheentry and namesLen bytes of names,
+// padded to 8 bytes
+struct cacherec {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+	int64_t ctimeSec;
+	int64_t ctimeNsec;
+	int64_t cachedAt;	// when the entries were read
+	int64_t statedAt;	// when the oldest of their stats was taken
+	int64_t usedAt;	// last run that used the record
+	uint64_t next;	// offset of the next record of the bucket, 0 if none
+	uint64_t index;
+	uint32_t count;
+	uint32_t namesLen;
+	int32_t flag;
+	uint32_t mask;	// statx fields the entries were stat'ed for
+};
+
+struct cacheentry {
+	struct stat sb;
+	uint32_t nameOffset;
+	uint8_t type;
+};
+
+static char *cachePath;
+static char *map;
+static size_t mapSize;
+static struct cachehead *head;
+static uint64_t *buckets;
+static unsigned char *recState;
+static time_t runStart;
+static long maxAge;
+
+// records read in this run, written out by saveCache()
+static pthread_mutex_t newLock = PTHREAD_MUTEX_INITIALIZER;
+static struct cacherec **newRecs;
+static size_t newCount;
+static size_t newSize;
+
+static size_t 
+recordSize(size_t count, size_t namesLen)
+{
+	size_t size;
+
+	size = sizeof(struct cacherec) + count * sizeof(struct cacheentry) + namesLen;
+	return (size + 7) & ~(size_t) 7;
+}
+
+static uint64_t 
+hashKey(uint64_t dev, uint64_t ino)
+{
+	uint64_t h;
+
+	h = (dev * 0x9E3779B97F4A7C15ULL) ^ ino;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static int 
+validHead()
+{
+	if (mapSize < sizeof(struct cachehead)) {
+		return 0;
+	}
+
+	head = (struct cachehead *) map;
+	buckets = (uint64_t *) (map + sizeof(struct cachehead));
+	return memcmp(head->magic, CACHE_MAGIC, 8) == 0 &&
+	    head->statSize == sizeof(struct stat) &&
+	    head->size == mapSize &&
+	    head->buckets > 0 && (head->buckets & (head->buckets - 1)) == 0 &&
+	    head->buckets <= (mapSize - sizeof(struct cachehead)) / sizeof(uint64_t);
+}
+
+// the record at offset, NULL if it does not lie within the map
+static struct cacherec *
+recordAt(uint64_t offset)
+{
+	struct cacherec *rec;
+	size_t dataStart;
+
+	dataStart = sizeof(struct cachehead) + head->buckets * sizeof(uint64_t);
+	if (offset < dataStart || offset % 8 != 0 || offset > mapSize - sizeof(struct cacherec)) {
+		return NULL;
+	}
+
+	rec = (struct cacherec *) (map + offset);
+	if (rec->count > (mapSize - offset) / sizeof(struct cacheentry) ||
+	    recordSize(rec->count, rec->namesLen) > mapSize - offset || rec->index >= head->records) {
+		return NULL;
+	}
+
+	return rec;
+}
+
+// map the file named by LS_CACHE, if any; a missing or unusable file is
+// treated as empty
+void 
+openCache()
+{
+	struct stat sb;
+	char *env;
+	char *endptr;
+	int fd;
+
+	if ((env = getenv("LS_CACHE")) == NULL || *env == '\0') {
+		return;
+	}
+
+	cachePath = env;
+	runStart = time(NULL);
+
+	maxAge = CACHE_MAX_AGE;
+	if ((env = getenv("LS_CACHE_MAX_AGE")) != NULL) {
+		maxAge = strtol(env, &endptr, 10);
+		if (*env == '\0' || *endptr != '\0' || maxAge < 0) {
+			maxAge = CACHE_MAX_AGE;
+		}
+	}
+
+	if ((fd = open(cachePath, O_RDONLY | O_CLOEXEC)) == -1) {
+		return;
+	}
+
+	if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+		mapSize = sb.st_size;
+		map = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED || !validHead()) {
+			if (map != MAP_FAILED) {
+				munmap(map, mapSize);
+			}
+			map = NULL;
+		}
+	}
+	close(fd);
+
+	if (map != NULL && (recState = calloc(head->records, 1)) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+}
+
+int 
+cacheEnabled()
+{
+	return cachePath != NULL;
+}
+
+static int 
+sameTime(int64_t sec, int64_t nsec, struct timespec *ts)
+{
+	return sec == ts->tv_sec && nsec == ts->tv_nsec;
+}
+
+// changed in the second it was cached or after, so possibly after it was
+// read
+static int 
+isRacy(time_t t, int64_t cachedAt)
+{
+	return t >= cachedAt - 1;
+}
+
+static void storeRecord(struct stat *, struct entrylist *, int64_t);
+
+// fill list with the cached entries of the directory open as fd, whose
+// stat is dirSb, under path, and stat again those that may have changed;
+// returns -1 if it is not cached or has changed
+int 
+lookupCache(int fd, struct stat *dirSb, char *path, struct entrylist *list)
+{
+	struct cacherec *rec;
+	struct cacheentry *ce;
+	struct entry *e, *stale;
+	char *names;
+	uint64_t offset, hops;
+	unsigned int mask;
+	int i, n, expired, fresh;
+
+	if (map == NULL) {
+		return -1;
+	}
+
+	rec = NULL;
+	offset = buckets[hashKey(dirSb->st_dev, dirSb->st_ino) & (head->buckets - 1)];
+	for (hops = 0; offset != 0 && hops < head->records; hops++) {
+		if ((rec = recordAt(offset)) == NULL) {
+			return -1;
+		}
+		if (rec->dev == dirSb->st_dev && rec->ino == dirSb->st_ino) {
+			break;
+		}
+		offset = rec->next;
+		rec = NULL;
+	}
+
+	if (rec == NULL) {
+		return -1;
+	}
+
+	mask = metaStatxMask();
+	names = (char *) rec + sizeof(struct cacherec) + rec->count * sizeof(struct cacheentry);
+	if (!sameTime(rec->mtimeSec, rec->mtimeNsec, &dirSb->st_mtim) ||
+	    !sameTime(rec->ctimeSec, rec->ctimeNsec, &dirSb->st_ctim) ||
+	    isRacy(dirSb->st_mtime, rec->cachedAt) || isRacy(dirSb->st_ctime, rec->cachedAt) ||
+	    rec->flag != filterHidden || (rec->mask & mask) != mask ||
+	    (rec->namesLen > 0 && names[rec->namesLen - 1] != '\0')) {
+		__atomic_store_n(&recState[rec->index], REC_REPLACED, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	// the names are copied as one block, so the pool does not move
+	if (rec->namesLen > list->namesSize) {
+		free(list->names);
+		list->namesSize = rec->namesLen;
+		if ((list->names = malloc(list->namesSize)) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+	if (rec->namesLen > 0) {
+		memcpy(list->names, names, rec->namesLen);
+	}
+	list->namesLen = rec->namesLen;
+
+	ce = (struct cacheentry *) ((char *) rec + sizeof(struct cacherec));
+	for (i = 0; i < (int) rec->count; i++) {
+		if (ce[i].nameOffset >= rec->namesLen) {
+			list->count = 0;
+			return -1;
+		}
+		addEntry(list, list->names + ce[i].nameOffset, path, NULL);
+		list->entries[i].type = ce[i].type;
+	}
+
+	// the entries that may have changed are gathered, sharing their stat
+	// buffers, and stat'ed in one batch
+	expired = runStart - rec->statedAt >= maxAge;
+	growStats(list);
+	stale = NULL;
+	n = 0;
+	fresh = 1;
+	for (i = 0; i < list->count; i++) {
+		e = &list->entries[i];
+		e->sb = &list->stats[i];
+		*e->sb = ce[i].sb;
+		if (!needStat(e->type)) {
+			continue;
+		}
+
+		if (expired || e->type == DT_DIR ||
+		    e->sb->st_ctime >= rec->statedAt - CACHE_HOT_AGE ||
+		    e->sb->st_mtime >= rec->statedAt - CACHE_HOT_AGE) {
+			if (stale == NULL && (stale = malloc((list->count - i) * sizeof(struct entry))) == NULL) {
+				perror("malloc");
+				exit(1);
+			}
+			stale[n++] = *e;
+			fresh = fresh && e->type == DT_DIR;
+		}
+	}
+
+	if (n > 0) {
+		statBatch(fd, stale, n);
+		free(stale);
+	}
+
+	// a record with files stat'ed again is replaced by a new one; the
+	// stats it keeps are as old as before, unless all are new
+	if (fresh) {
+		__atomic_store_n(&recState[rec->index], REC_USED, __ATOMIC_RELAXED);
+	} else {
+		__atomic_store_n(&recState[rec->index], REC_REPLACED, __ATOMIC_RELAXED);
+		storeRecord(dirSb, list, expired ? runStart : rec->statedAt);
+	}
+
+	return 0;
+}
+
+// remember the entries of list, read and stat'ed from the directory whose
+// stat is dirSb, for the next run
+void 
+storeCache(struct stat *dirSb, struct entrylist *list)
+{
+	storeRecord(dirSb, list, runStart);
+}
+
+// statedAt: when the oldest stat of list was taken
+static void 
+storeRecord(struct stat *dirSb, struct entrylist *list, int64_t statedAt)
+{
+	struct cacherec *rec;
+	struct cacheentry *ce;
+	int i;
+
+	if ((rec = calloc(1, recordSize(list->count, list->namesLen))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	rec->dev = dirSb->st_dev;
+	rec->ino = dirSb->st_ino;
+	rec->mtimeSec = dirSb->st_mtim.tv_sec;
+	rec->mtimeNsec = dirSb->st_mtim.tv_nsec;
+	rec->ctimeSec = dirSb->st_ctim.tv_sec;
+	rec->ctimeNsec = dirSb->st_ctim.tv_nsec;
+	rec->cachedAt = runStart;
+	rec->statedAt = statedAt;
+	rec->usedAt = runStart;
+	rec->count = list->count;
+	rec->namesLen = list->namesLen;
+	rec->flag = filterHidden;
+	rec->mask = metaStatxMask();
+
+	ce = (struct cacheentry *) ((char *) rec + sizeof(struct cacherec));
+	for (i = 0; i < list->count; i++) {
+		ce[i].sb = *list->entries[i].sb;
+		ce[i].nameOffset = list->entries[i].name - list->names;
+		ce[i].type = list->entries[i].type;
+	}
+	if (list->namesLen > 0) {
+		memcpy((char *) (ce + list->count), list->names, list->namesLen);
+	}
+
+	pthread_mutex_lock(&newLock);
+	if (newCount == newSize) {
+		newSize = (newSize == 0) ? 64 : newSize * 2;
+		if ((newRecs = realloc(newRecs, newSize * sizeof(struct cacherec *))) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	newRecs[newCount++] = rec;
+	pthread_mutex_unlock(&newLock);
+}
+
+static int 
+writeRecord(FILE *fp, const struct cacherec *rec, uint64_t next, uint64_t index, int64_t usedAt)
+{
+	static const char pad[8];
+	struct cacherec copy;
+	size_t body, padding;
+
+	copy = *rec;
+	copy.next = next;
+	copy.index = index;
+	copy.usedAt = usedAt;
+	body = rec->count * sizeof(struct cacheentry) + rec->namesLen;
+	padding = recordSize(rec->count, rec->namesLen) - sizeof(copy) - body;
+
+	return fwrite(&copy, sizeof(copy), 1, fp) == 1 &&
+	    fwrite(rec + 1, 1, body, fp) == body &&
+	    fwrite(pad, 1, padding, fp) == padding;
+}
+
+// write recs, of which the first oldCount come from the old file, to a
+// new file and put it in place of the old one
+static void 
+writeCache(struct cacherec **recs, size_t count, size_t oldCount)
+{
+	struct cachehead newHead;
+	uint64_t *newBuckets, *next, offset;
+	size_t i, b;
+	int64_t usedAt;
+	char *tmp;
+	FILE *fp;
+	int ok;
+
+	memcpy(newHead.magic, CACHE_MAGIC, 8);
+	newHead.statSize = sizeof(struct stat);
+	newHead.records = count;
+	for (newHead.buckets = 16; newHead.buckets < count; newHead.buckets *= 2)
+		;
+	if ((newBuckets = calloc(newHead.buckets, sizeof(uint64_t))) == NULL ||
+	    (next = malloc((count + 1) * sizeof(uint64_t))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	offset = sizeof(struct cachehead) + newHead.buckets * sizeof(uint64_t);
+	for (i = 0; i < count; i++) {
+		b = hashKey(recs[i]->dev, recs[i]->ino) & (newHead.buckets - 1);
+		next[i] = newBuckets[b];
+		newBuckets[b] = offset;
+		offset += recordSize(recs[i]->count, recs[i]->namesLen);
+	}
+	newHead.size = offset;
+
+	if ((tmp = malloc(strlen(cachePath) + 32)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	sprintf(tmp, "%s.%ld", cachePath, (long) getpid());
+
+	ok = 0;
+	if ((fp = fopen(tmp, "w")) != NULL) {
+		ok = fwrite(&newHead, sizeof(newHead), 1, fp) == 1 &&
+		    fwrite(newBuckets, sizeof(uint64_t), newHead.buckets, fp) == newHead.buckets;
+		for (i = 0; ok && i < count; i++) {
+			// old records used in this run are kept another CACHE_MAX_IDLE
+			usedAt = recs[i]->usedAt;
+			if (i < oldCount && recState[recs[i]->index] == REC_USED) {
+				usedAt = runStart;
+			}
+			ok = writeRecord(fp, recs[i], next[i], i, usedAt);
+		}
+		ok = (fclose(fp) == 0) && ok;
+	}
+
+	if (!ok || rename(tmp, cachePath) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", progname, cachePath, strerror(errno));
+		unlink(tmp);
+	}
+
+	free(newBuckets);
+	free(next);
+	free(tmp);
+}
+
+// write the records of this run and the old ones still worth keeping to
+// a new file, unless the old one holds the same
+void 
+saveCache()
+{
+	struct cacherec **recs, *rec;
+	unsigned char *seen;
+	uint64_t offset;
+	size_t count, oldCount, i;
+	int changed;
+
+	if (cachePath == NULL) {
+		return;
+	}
+
+	count = newCount;
+	if (map != NULL) {
+		count += head->records;
+	}
+	if ((recs = malloc((count + 1) * sizeof(struct cacherec *))) == NULL ||
+	    (seen = calloc((map != NULL) ? head->records + 1 : 1, 1)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	// old records are found by walking the buckets, which also skips any
+	// that are not reachable; in a corrupt file chains can meet or loop,
+	// so a record is taken once, by its index, and a chain ends at one
+	// already seen
+	count = 0;
+	changed = map == NULL || newCount > 0;
+	for (i = 0; map != NULL && i < head->buckets; i++) {
+		for (offset = buckets[i]; offset != 0 && (rec = recordAt(offset)) != NULL; offset = rec->next) {
+			if (seen[rec->index]) {
+				break;
+			}
+			seen[rec->index] = 1;
+			if (recState[rec->index] == REC_REPLACED ||
+			    (recState[rec->index] == REC_UNUSED && rec->usedAt < runStart - CACHE_MAX_IDLE)) {
+				changed = 1;
+				continue;
+			}
+			if (recState[rec->index] == REC_USED && rec->usedAt < runStart - CACHE_USED_REFRESH) {
+				changed = 1;
+			}
+			recs[count++] = rec;
+		}
+	}
+	oldCount = count;
+	for (i = 0; i < newCount; i++) {
+		recs[count++] = newRecs[i];
+	}
+
+	// a run that read only unchanged directories writes nothing
+	if (changed) {
+		writeCache(recs, count, oldCount);
+	}
+
+	for (i = 0; i < newCount; i++) {
+		free(newRecs[i]);
+	}
+	free(newRecs);
+	free(recs);
+	free(seen);
+	free(recState);
+	if (map != NULL) {
+		munmap(map, mapSize);
+	}
+}
@@ -0,0 +1,109 @@
+/*
+ * Date formatting cache for long listings.
+ * "now" and the timezone are read once per run. Formatted dates are kept
+ * in a small direct-mapped table keyed by the minute of the timestamp, so
+ * entries sharing a minute skip localtime_r() and strftime().
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "ls.h"
+
+#define DATECACHE_SIZE 256
+#define DATE_MAX 40
+
+// marks an empty slot; no time_t is that many minutes before the epoch
+#define NO_MINUTE LLONG_MIN
+
+// dates older than six months are printed with the year instead of the time
+#define RECENT_SECONDS (6 * 30 * 24 * 60 * 60)
+
+struct datename {
+	long long minute;	// NO_MINUTE => empty slot
+	int recent;
+	int len;
+	char date[DATE_MAX];
+};
+
+static struct datename dates[DATECACHE_SIZE];
+static time_t now;
+static int dateCacheReady;
+
+unsigned long dateCacheHits;
+unsigned long dateCacheMisses;
+
+static void 
+initDateCache()
+{
+	int i;
+
+	tzset();
+	time(&now);
+
+	for (i = 0; i < DATECACHE_SIZE; i++) {
+		dates[i].minute = NO_MINUTE;
+	}
+	dateCacheReady = 1;
+}
+
+static long long 
+minuteOf(time_t t)
+{
+	long long minute;
+
+	minute = (long long) t / 60;
+	if ((long long) t % 60 < 0) {
+		minute--;
+	}
+
+	return minute;
+}
+
+// len (if not NULL) is set to the length of the returned date
+const char *
+formatDate(time_t t, int *len)
+{
+	struct datename *slot;
+	struct tm tm;
+	long long minute;
+	int recent;
+
+	if (dateCacheReady == 0) {
+		initDateCache();
+	}
+
+	minute = minuteOf(t);
+	recent = difftime(now, t) < RECENT_SECONDS;
+	slot = &dates[(unsigned long long) minute % DATECACHE_SIZE];
+
+	if (slot->minute == minute && slot->recent == recent) {
+		dateCacheHits++;
+	} else {
+		dateCacheMisses++;
+		memset(slot->date, 0, DATE_MAX);
+		slot->minute = NO_MINUTE;
+		slot->recent = recent;
+
+		if (localtime_r(&t, &tm) != NULL) {
+			if (recent) {
+				strftime(slot->date, DATE_MAX, "%b %e %R", &tm);
+			} else {
+				strftime(slot->date, DATE_MAX, "%b %e  %G", &tm);
+			}
+
+			// a local minute only matches a UTC minute for whole-minute offsets
+			if (tm.tm_gmtoff % 60 == 0) {
+				slot->minute = minute;
+			}
+		}
+		slot->len = strlen(slot->date);
+	}
+
+	if (len != NULL) {
+		*len = slot->len;
+	}
+	return slot->date;
+}
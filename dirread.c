@@ -0,0 +1,359 @@
+/*
+ * Directory reader for non-recursive listings.
+ * Reads a directory with getdents64 into a large buffer and builds a
+ * compact entry list: names go into one pool, stats into one array, so a
+ * directory costs a handful of allocations however many entries it has.
+ * The buffer size can be set with the LS_DIRBUF_SIZE environment variable.
+ * Unsorted listings can instead be streamed one buffer at a time.
+ * Under -R directories are opened with openat() relative to their parent,
+ * whose fd is kept open while there are fds to spare, so opening a
+ * directory does not walk its whole path again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "ls.h"
+
+#define DIRBUF_DEFAULT_SIZE (256 * 1024)
+
+// directories smaller than this are stat'ed without io_uring
+#define URING_MIN_BATCH 16
+
+// fds not used for parent directories: stdio, io_uring rings, symlinks
+#define FD_RESERVE 64
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// one buffer per thread, the -R walker reads directories in parallel
+static __thread char *dirBuf;
+static __thread size_t dirBufSize;
+
+static void 
+initDirBuf()
+{
+	char *env;
+	char *endptr;
+	long size;
+
+	dirBufSize = DIRBUF_DEFAULT_SIZE;
+	if ((env = getenv("LS_DIRBUF_SIZE")) != NULL) {
+		size = strtol(env, &endptr, 10);
+		if (size >= (long) sizeof(struct linux_dirent64) + NAME_MAX + 1 && *endptr == '\0') {
+			dirBufSize = size;
+		}
+	}
+
+	if ((dirBuf = malloc(dirBufSize)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+}
+
+// parent directory fds held open, at most fdBudget of them
+static int fdBudget = -1;
+static int heldFds;
+
+static void 
+initFdBudget()
+{
+	struct rlimit rl;
+	long budget;
+
+	budget = 0;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		budget = (rl.rlim_cur == RLIM_INFINITY) ? 65536 : (long) rl.rlim_cur;
+		budget = (budget > 65536) ? 65536 : budget;
+		budget = budget / 2 - FD_RESERVE;
+	}
+
+	__atomic_store_n(&fdBudget, (budget > 0) ? (int) budget : 0, __ATOMIC_RELAXED);
+}
+
+// returns 1 if one more directory fd may be kept open as a parent; the
+// caller gives it back with releaseDirFd()
+int 
+holdDirFd()
+{
+	if (__atomic_load_n(&fdBudget, __ATOMIC_RELAXED) == -1) {
+		initFdBudget();
+	}
+
+	if (__atomic_add_fetch(&heldFds, 1, __ATOMIC_RELAXED) <= fdBudget) {
+		return 1;
+	}
+
+	__atomic_sub_fetch(&heldFds, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void 
+releaseDirFd(int fd)
+{
+	close(fd);
+	countStat(STAT_CLOSE, 1);
+	__atomic_sub_fetch(&heldFds, 1, __ATOMIC_RELAXED);
+}
+
+// open a directory relative to its parent if parentFd is open (not -1),
+// else by its path
+int 
+openDirectory(int parentFd, const char *name, const char *path)
+{
+	int fd, phase;
+
+	phase = enterPhase(PHASE_TRAVERSAL);
+	if (parentFd != -1) {
+		fd = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	} else {
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	countStat(STAT_OPEN, 1);
+	enterPhase(phase);
+
+	return fd;
+}
+
+// called by threads that read directories before they exit
+void 
+freeDirBuf()
+{
+	free(dirBuf);
+	dirBuf = NULL;
+}
+
+static size_t 
+addName(struct entrylist *list, const char *name)
+{
+	size_t len, offset;
+
+	len = strlen(name) + 1;
+	if (list->namesLen + len > list->namesSize) {
+		while (list->namesLen + len > list->namesSize) {
+			list->namesSize = (list->namesSize == 0) ? 4096 : list->namesSize * 2;
+		}
+		if ((list->names = realloc(list->names, list->namesSize)) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	offset = list->namesLen;
+	memcpy(list->names + offset, name, len);
+	list->namesLen += len;
+
+	return offset;
+}
+
+// make room for a stat per entry of list
+void 
+growStats(struct entrylist *list)
+{
+	if (list->count > list->statsSize) {
+		list->statsSize = list->count;
+		free(list->stats);
+		if ((list->stats = malloc(list->statsSize * sizeof(struct stat))) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+}
+
+// lstat count entries, whose sb are set, relative to the directory fd
+// when the flags need more than d_type
+void 
+statBatch(int fd, struct entry *entries, int count)
+{
+	struct entry *e;
+	int i, phase;
+
+	phase = enterPhase(PHASE_METADATA);
+	i = 0;
+	if (count >= URING_MIN_BATCH) {
+		i = uringStatEntries(fd, entries, count);
+	}
+
+	for (; i < count; i++) {
+		e = &entries[i];
+		if (needStat(e->type) == 0) {
+			fillTypeStat(e->sb, e->type);
+			continue;
+		}
+
+		// an entry that vanished is listed with an empty stat, like fts does
+		if (fetchMeta(fd, e->name, e->sb) == -1) {
+			memset(e->sb, 0, sizeof(struct stat));
+		}
+	}
+	enterPhase(phase);
+}
+
+static void 
+statEntries(int fd, struct entrylist *list)
+{
+	int i;
+
+	growStats(list);
+	for (i = 0; i < list->count; i++) {
+		list->entries[i].sb = &list->stats[i];
+	}
+
+	statBatch(fd, list->entries, list->count);
+}
+
+// read the entries of the open directory fd into list (which is emptied
+// first) and lstat them relative to it when the flags need more than
+// d_type; path becomes the parent path of the entries
+// entries are filtered by name as they are read and by stat after that
+// with LS_CACHE set, unchanged directories come from the cache instead
+// returns -1 with errno set if the directory can not be read
+int 
+readDirectory(int fd, char *path, struct entrylist *list)
+{
+	struct linux_dirent64 *d;
+	struct stat dirSb;
+	long n, pos;
+	int i, phase, cached;
+
+	if (dirBuf == NULL) {
+		initDirBuf();
+	}
+
+	list->count = 0;
+	list->namesLen = 0;
+	list->walkOnly = 0;
+
+	// the cache keeps whole listings, so it is not used with predicates
+	cached = 0;
+	if (cacheEnabled() && !filterActive()) {
+		phase = enterPhase(PHASE_TRAVERSAL);
+		countStat(STAT_STAT, 1);
+		cached = (fstat(fd, &dirSb) == 0);
+		if (cached && lookupCache(fd, &dirSb, path, list) == 0) {
+			countStat(STAT_CACHE_HITS, 1);
+			countStat(STAT_DIRS, 1);
+			countStat(STAT_ENTRIES, list->count);
+			enterPhase(phase);
+			return 0;
+		}
+		countStat(STAT_CACHE_MISSES, 1);
+		list->count = 0;
+		list->namesLen = 0;
+		enterPhase(phase);
+	}
+
+	// names are stored as pool offsets until the pool stops moving
+	phase = enterPhase(PHASE_TRAVERSAL);
+	while ((n = syscall(SYS_getdents64, fd, dirBuf, dirBufSize)) > 0) {
+		countStat(STAT_GETDENTS, 1);
+		for (pos = 0; pos < n; pos += d->d_reclen) {
+			d = (struct linux_dirent64 *) (dirBuf + pos);
+			if (!filterName(d->d_name, d->d_type)) {
+				continue;
+			}
+
+			addEntry(list, (char *) (uintptr_t) addName(list, d->d_name), path, NULL);
+			list->entries[list->count - 1].type = d->d_type;
+		}
+	}
+
+	countStat(STAT_GETDENTS, 1);
+	enterPhase(phase);
+
+	if (n == -1) {
+		list->count = 0;
+		return -1;
+	}
+
+	for (i = 0; i < list->count; i++) {
+		list->entries[i].name = list->names + (uintptr_t) list->entries[i].name;
+	}
+	countStat(STAT_DIRS, 1);
+	countStat(STAT_ENTRIES, list->count);
+
+	statEntries(fd, list);
+	if (cached) {
+		storeCache(&dirSb, list);
+	}
+	filterEntries(list);
+
+	return 0;
+}
+
+// read path one getdents buffer at a time and pass every entry to emit in
+// directory order; the output is flushed after each buffer, so memory use
+// does not grow with the directory and the first entries show up at once
+// returns -1 with errno set if the directory can not be read
+int 
+streamDirectory(char *path, void (*emit)(struct entry *))
+{
+	struct linux_dirent64 *d;
+	struct entrylist batch;
+	long n, pos;
+	int fd, i, saved, phase;
+
+	if (dirBuf == NULL) {
+		initDirBuf();
+	}
+
+	if ((fd = openDirectory(-1, NULL, path)) == -1) {
+		return -1;
+	}
+
+	// names point into dirBuf, which is only reused once the batch is out
+	initEntryList(&batch);
+	phase = enterPhase(PHASE_TRAVERSAL);
+	while ((n = syscall(SYS_getdents64, fd, dirBuf, dirBufSize)) > 0) {
+		countStat(STAT_GETDENTS, 1);
+		batch.count = 0;
+		for (pos = 0; pos < n; pos += d->d_reclen) {
+			d = (struct linux_dirent64 *) (dirBuf + pos);
+			if (!filterName(d->d_name, d->d_type)) {
+				continue;
+			}
+
+			addEntry(&batch, d->d_name, path, NULL);
+			batch.entries[batch.count - 1].type = d->d_type;
+		}
+
+		countStat(STAT_ENTRIES, batch.count);
+
+		statEntries(fd, &batch);
+		filterEntries(&batch);
+		enterPhase(phase);
+		for (i = 0; i < batch.count; i++) {
+			emit(&batch.entries[i]);
+		}
+		flushOutput();
+		phase = enterPhase(PHASE_TRAVERSAL);
+	}
+	saved = errno;
+	countStat(STAT_GETDENTS, 1);
+	enterPhase(phase);
+
+	close(fd);
+	countStat(STAT_CLOSE, 1);
+	freeEntryList(&batch);
+
+	if (n == -1) {
+		errno = saved;
+		return -1;
+	}
+	countStat(STAT_DIRS, 1);
+
+	return 0;
+}
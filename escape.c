@@ -0,0 +1,167 @@
+/*
+ * Escaping of non-printable characters in file names for -q and -w.
+ * A scanner finds the first byte that has to be escaped, 32 or 16 bytes
+ * at a time with AVX2 or SSE2 where available, and clean runs are copied
+ * with memcpy; a name without such bytes is printed as it is, so the
+ * common case costs one scan.
+ *
+ * -q: bytes outside ' '..'~' become '?'
+ * -w: control characters become ^A..^_ and DEL becomes \177, other bytes
+ *     are left alone
+ */
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "ls.h"
+
+static int 
+isUnsafe(unsigned char ch, int mode)
+{
+	if (mode == ESCAPE_QUESTION) {
+		return ch < ' ' || ch > '~';
+	}
+
+	return (ch > 0 && ch < ' ') || ch == 127;
+}
+
+static size_t 
+scanScalar(const char *s, size_t pos, size_t len, int mode)
+{
+	while (pos < len && !isUnsafe(s[pos], mode)) {
+		pos++;
+	}
+
+	return pos;
+}
+
+#ifdef __SSE2__
+
+// bit i of the result is set if byte i of v has to be escaped; the
+// comparisons are signed, so bytes >= 0x80 are below ' '
+static inline unsigned int 
+unsafeMask16(__m128i v, int mode)
+{
+	__m128i low, del;
+
+	low = _mm_cmplt_epi8(v, _mm_set1_epi8(' '));
+	del = _mm_cmpeq_epi8(v, _mm_set1_epi8(127));
+	if (mode == ESCAPE_CARET) {
+		low = _mm_and_si128(low, _mm_cmpgt_epi8(v, _mm_setzero_si128()));
+	}
+
+	return _mm_movemask_epi8(_mm_or_si128(low, del));
+}
+
+static size_t 
+scanSSE2(const char *s, size_t len, int mode)
+{
+	unsigned int mask;
+	size_t pos;
+
+	for (pos = 0; pos + 16 <= len; pos += 16) {
+		mask = unsafeMask16(_mm_loadu_si128((const __m128i *) (s + pos)), mode);
+		if (mask != 0) {
+			return pos + __builtin_ctz(mask);
+		}
+	}
+
+	return scanScalar(s, pos, len, mode);
+}
+
+__attribute__((target("avx2")))
+static size_t 
+scanAVX2(const char *s, size_t len, int mode)
+{
+	__m256i v, low, del;
+	unsigned int mask;
+	size_t pos;
+
+	for (pos = 0; pos + 32 <= len; pos += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (s + pos));
+		low = _mm256_cmpgt_epi8(_mm256_set1_epi8(' '), v);
+		del = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(127));
+		if (mode == ESCAPE_CARET) {
+			low = _mm256_and_si256(low, _mm256_cmpgt_epi8(v, _mm256_setzero_si256()));
+		}
+
+		mask = _mm256_movemask_epi8(_mm256_or_si256(low, del));
+		if (mask != 0) {
+			return pos + __builtin_ctz(mask);
+		}
+	}
+
+	if (pos + 16 <= len) {
+		mask = unsafeMask16(_mm_loadu_si128((const __m128i *) (s + pos)), mode);
+		if (mask != 0) {
+			return pos + __builtin_ctz(mask);
+		}
+		pos += 16;
+	}
+
+	return scanScalar(s, pos, len, mode);
+}
+
+#endif
+
+// index of the first byte of s[0..len) that has to be escaped, len if none
+size_t 
+scanUnsafe(const char *s, size_t len, int mode)
+{
+#ifdef __SSE2__
+	static int hasAVX2 = -1;
+
+	if (hasAVX2 == -1) {
+		hasAVX2 = __builtin_cpu_supports("avx2");
+	}
+
+	return hasAVX2 ? scanAVX2(s, len, mode) : scanSSE2(s, len, mode);
+#else
+	return scanScalar(s, 0, len, mode);
+#endif
+}
+
+// returns name itself if nothing has to be escaped, else an escaped copy
+// taken from the arena; *len is the length of name on entry and of the
+// result on return
+char *
+escapeName(char *name, size_t *len, int mode)
+{
+	char *escaped, *out;
+	size_t pos, next;
+	unsigned char ch;
+
+	if ((pos = scanUnsafe(name, *len, mode)) == *len) {
+		return name;
+	}
+
+	escaped = arenaAlloc((mode == ESCAPE_QUESTION) ? *len + 1 : *len * 4 + 1);
+	memcpy(escaped, name, pos);
+	out = escaped + pos;
+
+	while (pos < *len) {
+		ch = name[pos++];
+		if (mode == ESCAPE_QUESTION) {
+			*out++ = '?';
+		} else if (ch == 127) {
+			memcpy(out, "\\177", 4);
+			out += 4;
+		} else {
+			*out++ = '^';
+			*out++ = ch + 'A' - 1;
+		}
+
+		next = pos + scanUnsafe(name + pos, *len - pos, mode);
+		memcpy(out, name + pos, next - pos);
+		out += next - pos;
+		pos = next;
+	}
+
+	*out = '\0';
+	*len = out - escaped;
+
+	return escaped;
+}
@@ -0,0 +1,432 @@
+/*
+ * Predicates that select the entries of a directory listing.
+ *   hidden files  dropped without -a or -A, . and .. dropped with -A
+ *   --name GLOB   the name matches the shell pattern GLOB
+ *   --regex RE    the name matches the extended regular expression RE
+ *   --type TYPES  the file type is one of TYPES: f d l c b p s
+ *   --size RANGE  the size, in bytes or k, M, G, T
+ *   --time RANGE  the age of the time -c and -u select, in days or s, m,
+ *                 h, d, w
+ * A RANGE is N (exactly N units), +N (more), -N (less) or A..B (from A to
+ * B, either may be left out); sizes are rounded up and ages down to whole
+ * units, as find does.
+ * All predicates given must hold.
+ * Name and d_type predicates are checked as the directory is read, so an
+ * entry they reject is never stat'ed; the rest is checked once the
+ * entries that are left have been stat'ed, and the entries that fail are
+ * dropped before sorting and widths. Under -R, directories that fail are
+ * not listed but still walked (after the listed ones), so entries deeper
+ * down can match; hidden directories are not walked.
+ * Operands are not filtered.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "ls.h"
+
+// low <= value / lowUnit and value / highUnit <= high, rounded up for
+// sizes and down for ages, as find does
+struct range {
+	long long low;
+	long long lowUnit;
+	long long high;
+	long long highUnit;
+	int roundUp;
+};
+
+struct predicate {
+	int kind;	// FILTER_NAME ...
+	char *pattern;	// FILTER_NAME
+	regex_t regex;	// FILTER_REGEX
+	mode_t types[8];	// FILTER_TYPE, S_IFMT values, 0 terminated
+	struct range range;	// FILTER_SIZE and FILTER_TIME
+};
+
+int filterHidden;
+
+static int filterWalk;
+static time_t filterNow;
+
+static struct predicate *preds;
+static int predCount;
+static int namePreds;	// FILTER_NAME and FILTER_REGEX
+
+// hidden: NOFLAG, FLAG_A or FLAG_a; walk: 1 under -R
+void 
+initFilter(int hidden, int walk)
+{
+	filterHidden = hidden;
+	filterWalk = walk;
+	filterNow = time(NULL);
+}
+
+// N with an optional unit suffix; returns the end of it or NULL
+static const char *
+parseAmount(const char *s, const char *units, const long long *scales, long long defaultScale, long long *value, long long *unit)
+{
+	const char *u;
+	char *end;
+
+	if (*s < '0' || *s > '9') {
+		return NULL;
+	}
+
+	*value = strtoll(s, &end, 10);
+	*unit = defaultScale;
+	if (*end != '\0' && (u = strchr(units, *end)) != NULL) {
+		*unit = scales[u - units];
+		end++;
+	}
+
+	return end;
+}
+
+static int 
+parseRange(const char *arg, const char *units, const long long *scales, long long defaultScale, struct range *r)
+{
+	const char *s;
+	long long value, unit;
+
+	r->low = LLONG_MIN;
+	r->lowUnit = 1;
+	r->high = LLONG_MAX;
+	r->highUnit = 1;
+
+	if (arg[0] == '+' || arg[0] == '-') {
+		s = parseAmount(arg + 1, units, scales, defaultScale, &value, &unit);
+		if (s == NULL || *s != '\0') {
+			return -1;
+		}
+		if (arg[0] == '+') {
+			r->low = value + 1;
+			r->lowUnit = unit;
+		} else {
+			r->high = value - 1;
+			r->highUnit = unit;
+		}
+		return 0;
+	}
+
+	s = arg;
+	if (strncmp(s, "..", 2) != 0) {
+		if ((s = parseAmount(s, units, scales, defaultScale, &r->low, &r->lowUnit)) == NULL) {
+			return -1;
+		}
+		if (*s == '\0') {
+			r->high = r->low;
+			r->highUnit = r->lowUnit;
+			return 0;
+		}
+	}
+
+	if (strncmp(s, "..", 2) != 0) {
+		return -1;
+	}
+	s += 2;
+	if (*s != '\0' && ((s = parseAmount(s, units, scales, defaultScale, &r->high, &r->highUnit)) == NULL || *s != '\0')) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int 
+parseTypes(const char *arg, mode_t *types)
+{
+	static const char letters[] = "fdlcbps";
+	static const mode_t modes[] = {S_IFREG, S_IFDIR, S_IFLNK, S_IFCHR, S_IFBLK, S_IFIFO, S_IFSOCK};
+	const char *l;
+	int n;
+
+	n = 0;
+	for (; *arg != '\0'; arg++) {
+		if ((l = strchr(letters, *arg)) == NULL || n == 7) {
+			return -1;
+		}
+		types[n++] = modes[l - letters];
+	}
+	types[n] = 0;
+
+	return (n > 0) ? 0 : -1;
+}
+
+// add a predicate of the given kind (FILTER_NAME ...) with the argument
+// of its option; returns -1 if the argument is not valid
+int 
+addPredicate(int kind, const char *arg)
+{
+	static const long long sizeScales[] = {1024LL, 1024LL << 10, 1024LL << 20, 1024LL << 30};
+	static const long long timeScales[] = {1, 60, 3600, 86400, 7 * 86400};
+	struct predicate *p;
+	int error;
+
+	if ((preds = realloc(preds, (predCount + 1) * sizeof(struct predicate))) == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	p = &preds[predCount];
+	memset(p, 0, sizeof(struct predicate));
+	p->kind = kind;
+
+	switch (kind) {
+		case FILTER_NAME:
+			p->pattern = (char *) arg;
+			error = 0;
+			namePreds++;
+			break;
+		case FILTER_REGEX:
+			error = regcomp(&p->regex, arg, REG_EXTENDED | REG_NOSUB) != 0;
+			namePreds++;
+			break;
+		case FILTER_TYPE:
+			error = parseTypes(arg, p->types);
+			break;
+		case FILTER_SIZE:
+			error = parseRange(arg, "kMGT", sizeScales, 1, &p->range);
+			p->range.roundUp = 1;
+			break;
+		case FILTER_TIME:
+			error = parseRange(arg, "smhdw", timeScales, 86400, &p->range);
+			break;
+		default:
+			return -1;
+	}
+
+	if (error) {
+		return -1;
+	}
+	predCount++;
+
+	return 0;
+}
+
+// 1 if there are predicates besides the hidden file rule
+int 
+filterActive()
+{
+	return predCount > 0;
+}
+
+// stat fields the predicates need (META_*)
+int 
+filterDemand()
+{
+	int i, demand;
+
+	demand = 0;
+	for (i = 0; i < predCount; i++) {
+		switch (preds[i].kind) {
+			case FILTER_TYPE:
+				demand |= META_TYPE;
+				break;
+			case FILTER_SIZE:
+				demand |= META_SIZE;
+				break;
+			case FILTER_TIME:
+				demand |= META_TIME;
+				break;
+		}
+	}
+
+	// a directory has to be known as one to be walked
+	if (filterWalk && predCount > 0) {
+		demand |= META_TYPE;
+	}
+
+	return demand;
+}
+
+static int 
+isHidden(const char *name)
+{
+	if (name[0] != '.' || filterHidden == FLAG_a) {
+		return 0;
+	}
+
+	if (filterHidden == NOFLAG) {
+		return 1;
+	}
+
+	return name[1] == '\0' || (name[1] == '.' && name[2] == '\0');
+}
+
+static int 
+matchNames(const char *name)
+{
+	int i;
+
+	for (i = 0; i < predCount; i++) {
+		if (preds[i].kind == FILTER_NAME && fnmatch(preds[i].pattern, name, 0) != 0) {
+			return 0;
+		}
+		if (preds[i].kind == FILTER_REGEX && regexec(&preds[i].regex, name, 0, NULL, 0) != 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int 
+matchType(struct predicate *p, mode_t mode)
+{
+	int i;
+
+	for (i = 0; p->types[i] != 0; i++) {
+		if ((mode & S_IFMT) == p->types[i]) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static long long 
+floorDiv(long long value, long long unit)
+{
+	long long q;
+
+	q = value / unit;
+	return (value % unit != 0 && value < 0) ? q - 1 : q;
+}
+
+static int 
+inRange(struct range *r, long long value)
+{
+	if (r->roundUp) {
+		return -floorDiv(-value, r->lowUnit) >= r->low && -floorDiv(-value, r->highUnit) <= r->high;
+	}
+
+	return floorDiv(value, r->lowUnit) >= r->low && floorDiv(value, r->highUnit) <= r->high;
+}
+
+static int 
+matchStat(struct stat *sb)
+{
+	struct predicate *p;
+	time_t t;
+	int i;
+
+	for (i = 0; i < predCount; i++) {
+		p = &preds[i];
+		switch (p->kind) {
+			case FILTER_TYPE:
+				if (!matchType(p, sb->st_mode)) {
+					return 0;
+				}
+				break;
+			case FILTER_SIZE:
+				if (!inRange(&p->range, sb->st_size)) {
+					return 0;
+				}
+				break;
+			case FILTER_TIME:
+				t = (timeFlag == FILE_ATIME) ? sb->st_atime : (timeFlag == FILE_CTIME) ? sb->st_ctime : sb->st_mtime;
+				if (!inRange(&p->range, (long long) filterNow - t)) {
+					return 0;
+				}
+				break;
+		}
+	}
+
+	return 1;
+}
+
+// check an entry as it is read, before any stat; returns 1 if it has to
+// be kept, type is its d_type (DT_UNKNOWN if not known)
+int 
+filterName(const char *name, unsigned char type)
+{
+	struct predicate *p;
+	int i, walked;
+
+	if (isHidden(name)) {
+		return 0;
+	}
+
+	if (predCount == 0) {
+		return 1;
+	}
+
+	// directories that fail are kept to be walked under -R
+	walked = filterWalk && (type == DT_DIR || type == DT_UNKNOWN);
+	if (namePreds > 0 && !matchNames(name) && !walked) {
+		return 0;
+	}
+
+	if (type == DT_UNKNOWN || walked) {
+		return 1;
+	}
+
+	for (i = 0; i < predCount; i++) {
+		p = &preds[i];
+		if (p->kind == FILTER_TYPE && !matchType(p, DTTOIF(type))) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// 1 if the stat'ed entry e passes all predicates
+int 
+filterEntry(struct entry *e)
+{
+	if (isHidden(e->name) || (namePreds > 0 && !matchNames(e->name))) {
+		return 0;
+	}
+
+	return matchStat(e->sb);
+}
+
+// drop the entries of list that fail, once they are stat'ed; under -R
+// directories that fail are moved past list->count to be walked only
+void 
+filterEntries(struct entrylist *list)
+{
+	struct entry *e, *walkOnly;
+	int i, kept, walked;
+
+	list->walkOnly = 0;
+	if (predCount == 0) {
+		return;
+	}
+
+	// names were checked as they were read, except for those that may be
+	// directories under -R
+	walkOnly = NULL;
+	kept = 0;
+	walked = 0;
+	for (i = 0; i < list->count; i++) {
+		e = &list->entries[i];
+		if (matchStat(e->sb) && (!filterWalk || namePreds == 0 || matchNames(e->name))) {
+			list->entries[kept++] = *e;
+			continue;
+		}
+
+		if (!filterWalk || !S_ISDIR(e->sb->st_mode) || strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) {
+			continue;
+		}
+
+		if (walkOnly == NULL && (walkOnly = malloc((list->count - i) * sizeof(struct entry))) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		walkOnly[walked++] = *e;
+	}
+
+	if (walked > 0) {
+		memcpy(list->entries + kept, walkOnly, walked * sizeof(struct entry));
+		free(walkOnly);
+	}
+	list->count = kept;
+	list->walkOnly = walked;
+}
@@ -0,0 +1,181 @@
+/*
+ * Formatting kernels for the listing columns.
+ * Digit counts come from a power of ten table, numbers are converted two
+ * digits at a time, mode strings are looked up in a table built once from
+ * the permission bits, and human readable sizes are computed with integer
+ * arithmetic. The results are the same as the snprintf()/strmode() and
+ * long double code they replace.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "ls.h"
+
+static const unsigned long long powersOf10[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL,
+	10000000000000000000ULL
+};
+
+static const char digitPairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// file type letters indexed by (st_mode & S_IFMT) >> 12, as strmode() does
+static const char typeChars[16] = {
+	'?', 'p', 'c', '?', 'd', '?', 'b', '?',
+	'-', '?', 'l', '?', 's', '?', '?', '?'
+};
+
+// "rwxr-xr-x" for all combinations of the permission, setuid, setgid and
+// sticky bits
+static char permStrings[07777 + 1][9];
+static int permStringsReady;
+
+int 
+countDigits(unsigned long long value)
+{
+	int guess;
+
+	// 0 has one digit; setting the low bit never changes the count
+	value |= 1;
+
+	// log10(2) ~ 1233 / 4096, may be one too high
+	guess = ((64 - __builtin_clzll(value)) * 1233) >> 12;
+	return guess + 1 - (value < powersOf10[guess]);
+}
+
+// writes the digits of value so that they end just before end, returns
+// the number of digits
+int 
+formatUnsigned(char *end, unsigned long long value)
+{
+	char *p;
+	unsigned int pair;
+
+	p = end;
+	while (value >= 100) {
+		pair = (value % 100) * 2;
+		value /= 100;
+		*--p = digitPairs[pair + 1];
+		*--p = digitPairs[pair];
+	}
+
+	if (value >= 10) {
+		pair = value * 2;
+		*--p = digitPairs[pair + 1];
+		*--p = digitPairs[pair];
+	} else {
+		*--p = '0' + value;
+	}
+
+	return end - p;
+}
+
+static void 
+fillPermTriple(char *s, int bits, int special, char set, char setNoExec)
+{
+	s[0] = (bits & 4) ? 'r' : '-';
+	s[1] = (bits & 2) ? 'w' : '-';
+	if (special) {
+		s[2] = (bits & 1) ? set : setNoExec;
+	} else {
+		s[2] = (bits & 1) ? 'x' : '-';
+	}
+}
+
+static void 
+initPermStrings()
+{
+	int mode;
+
+	for (mode = 0; mode <= 07777; mode++) {
+		fillPermTriple(permStrings[mode], mode >> 6, mode & S_ISUID, 's', 'S');
+		fillPermTriple(permStrings[mode] + 3, mode >> 3, mode & S_ISGID, 's', 'S');
+		fillPermTriple(permStrings[mode] + 6, mode, mode & S_ISVTX, 't', 'T');
+	}
+
+	permStringsReady = 1;
+}
+
+// the first 10 characters of strmode(), without the trailing space
+void 
+formatMode(mode_t mode, char *s)
+{
+	if (permStringsReady == 0) {
+		initPermStrings();
+	}
+
+	s[0] = typeChars[(mode & S_IFMT) >> 12];
+	memcpy(s + 1, permStrings[mode & 07777], 9);
+}
+
+// right aligned in len - 1 characters: the size itself below 1024, else
+// one decimal below 10 and a whole number above, followed by the unit;
+// output that does not fit is cut like snprintf() would
+void 
+humanizeSize(long long filesize, char *size, int len)
+{
+	static const char units[] = {' ', 'K', 'M', 'G', 'T', 'P'};
+	char temp[32];
+	char *end;
+	unsigned long long value, scale, tenths, rest;
+	int i, n;
+
+	end = temp + sizeof(temp);
+	if (filesize < 1024) {
+		if (filesize < 0) {
+			snprintf(size, len, "%*d", len - 1, (int) filesize);
+			return;
+		}
+		n = formatUnsigned(end, filesize);
+	} else {
+		value = filesize;
+		i = 0;
+		while (i < 5 && value >> (10 * (i + 1)) != 0) {
+			i++;
+		}
+		scale = 1ULL << (10 * i);
+
+		*--end = units[i];
+		if (value < 10 * scale) {
+			// rounded to nearest tenth, ties to even like printf
+			tenths = (unsigned long long) ((unsigned __int128) value * 10 / scale);
+			rest = (unsigned long long) ((unsigned __int128) value * 10 % scale);
+			if (rest > scale / 2 || (rest == scale / 2 && (tenths & 1))) {
+				tenths++;
+			}
+			*--end = '0' + tenths % 10;
+			*--end = '.';
+			n = formatUnsigned(end, tenths / 10) + 2;
+		} else {
+			n = formatUnsigned(end, (value + scale / 2) >> (10 * i));
+		}
+		n++;
+	}
+
+	// pad like "%*d%c" / "%*.1Lf%c" and cut to len - 1
+	end = temp + sizeof(temp) - n;
+	i = 0;
+	while (i < len - 1 - n) {
+		size[i++] = ' ';
+	}
+	while (n > 0 && i < len - 1) {
+		size[i++] = *end++;
+		n--;
+	}
+	size[i] = '\0';
+}
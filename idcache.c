@@ -0,0 +1,164 @@
+/*
+ * uid -> user name and gid -> group name cache.
+ * Each id is looked up through getpwuid()/getgrgid() only once per run;
+ * the width pass and the print pass both read from the cache.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pwd.h>
+#include <grp.h>
+
+#include "ls.h"
+
+#define IDCACHE_INITIAL_SIZE 64
+
+struct idname {
+	unsigned int id;
+	int len;
+	char *name;	// NULL => empty slot
+};
+
+// open addressing with linear probing, size is a power of two
+struct idcache {
+	struct idname *slots;
+	unsigned int size;
+	unsigned int count;
+};
+
+static struct idcache users;
+static struct idcache groups;
+
+unsigned long idCacheHits;
+unsigned long idCacheMisses;
+
+static unsigned int 
+hashId(unsigned int id)
+{
+	id *= 2654435761u;
+	return id ^ (id >> 16);
+}
+
+static struct idname *
+findSlot(struct idcache *cache, unsigned int id)
+{
+	unsigned int i;
+
+	i = hashId(id) & (cache->size - 1);
+	while (cache->slots[i].name != NULL && cache->slots[i].id != id) {
+		i = (i + 1) & (cache->size - 1);
+	}
+
+	return &cache->slots[i];
+}
+
+static void 
+growCache(struct idcache *cache)
+{
+	struct idname *old;
+	unsigned int oldSize, i;
+
+	old = cache->slots;
+	oldSize = cache->size;
+
+	cache->size = (oldSize == 0) ? IDCACHE_INITIAL_SIZE : oldSize * 2;
+	if ((cache->slots = calloc(cache->size, sizeof(struct idname))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < oldSize; i++) {
+		if (old[i].name != NULL) {
+			*findSlot(cache, old[i].id) = old[i];
+		}
+	}
+
+	free(old);
+}
+
+// name = NULL => the id has no entry, its number is cached instead
+static struct idname *
+insertId(struct idcache *cache, unsigned int id, const char *name)
+{
+	struct idname *slot;
+	char num[32];
+
+	if (name == NULL) {
+		snprintf(num, sizeof(num), "%u", id);
+		name = num;
+	}
+
+	if ((cache->count + 1) * 2 > cache->size) {
+		growCache(cache);
+	}
+
+	slot = findSlot(cache, id);
+	slot->id = id;
+	slot->len = strlen(name);
+	if ((slot->name = strdup(name)) == NULL) {
+		perror("strdup");
+		exit(1);
+	}
+	cache->count++;
+
+	return slot;
+}
+
+static struct idname *
+lookupId(struct idcache *cache, unsigned int id)
+{
+	struct idname *slot;
+
+	if (cache->size == 0) {
+		return NULL;
+	}
+
+	slot = findSlot(cache, id);
+	if (slot->name == NULL) {
+		return NULL;
+	}
+
+	return slot;
+}
+
+// len (if not NULL) is set to the length of the returned name
+const char *
+userName(uid_t uid, int *len)
+{
+	struct idname *slot;
+	struct passwd *userInfo;
+
+	if ((slot = lookupId(&users, uid)) != NULL) {
+		idCacheHits++;
+	} else {
+		idCacheMisses++;
+		userInfo = getpwuid(uid);
+		slot = insertId(&users, uid, userInfo != NULL ? userInfo->pw_name : NULL);
+	}
+
+	if (len != NULL) {
+		*len = slot->len;
+	}
+	return slot->name;
+}
+
+const char *
+groupName(gid_t gid, int *len)
+{
+	struct idname *slot;
+	struct group *groupInfo;
+
+	if ((slot = lookupId(&groups, gid)) != NULL) {
+		idCacheHits++;
+	} else {
+		idCacheMisses++;
+		groupInfo = getgrgid(gid);
+		slot = insertId(&groups, gid, groupInfo != NULL ? groupInfo->gr_name : NULL);
+	}
+
+	if (len != NULL) {
+		*len = slot->len;
+	}
+	return slot->name;
+}
@@ -0,0 +1,191 @@
+/*
+ * Column layout for -C and -x.
+ * Column counts are tried from the most that could fit the line down to
+ * one; the first whose columns, each as wide as its widest cell plus two
+ * spaces, fit the line wins, which gives the same layout as GNU ls.
+ * A candidate is dropped as soon as its line gets too long. For -C every
+ * column is a run of consecutive cells, whose widest cell is found from
+ * per-block maxima, so a candidate costs about O(columns * BLOCK + n /
+ * BLOCK) instead of O(n) and even huge directories are laid out quickly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ls.h"
+
+// one character and the separator
+#define MIN_COLUMN_WIDTH 3
+
+// cells per block of the -C maxima
+#define BLOCK 64
+
+static int *colWidths;
+static int colWidthsSize;
+static int *blockMax;
+static int blockMaxSize;
+
+static int *
+growInts(int *array, int *size, int need)
+{
+	if (need <= *size) {
+		return array;
+	}
+
+	free(array);
+	if ((array = malloc(need * sizeof(int))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	*size = need;
+
+	return array;
+}
+
+static void 
+computeBlockMax(const int *cellWidths, int count)
+{
+	int b, i, end;
+
+	blockMax = growInts(blockMax, &blockMaxSize, (count + BLOCK - 1) / BLOCK);
+	for (b = 0; b * BLOCK < count; b++) {
+		end = (b + 1) * BLOCK < count ? (b + 1) * BLOCK : count;
+		blockMax[b] = 0;
+		for (i = b * BLOCK; i < end; i++) {
+			if (blockMax[b] < cellWidths[i]) {
+				blockMax[b] = cellWidths[i];
+			}
+		}
+	}
+}
+
+// widest of cellWidths[lo..hi)
+static int 
+rangeMax(const int *cellWidths, int lo, int hi)
+{
+	int max;
+
+	max = 0;
+	while (lo < hi && lo % BLOCK != 0) {
+		if (max < cellWidths[lo]) {
+			max = cellWidths[lo];
+		}
+		lo++;
+	}
+
+	while (lo + BLOCK <= hi) {
+		if (max < blockMax[lo / BLOCK]) {
+			max = blockMax[lo / BLOCK];
+		}
+		lo += BLOCK;
+	}
+
+	while (lo < hi) {
+		if (max < cellWidths[lo]) {
+			max = cellWidths[lo];
+		}
+		lo++;
+	}
+
+	return max;
+}
+
+// the width a column takes in the line; empty columns still count
+static int 
+columnWidth(int cellWidth, int col, int cols)
+{
+	int width;
+
+	width = cellWidth + (col == cols - 1 ? 0 : 2);
+	return width < MIN_COLUMN_WIDTH ? MIN_COLUMN_WIDTH : width;
+}
+
+// returns 1 and fills colWidths if cols columns filled top to bottom fit
+static int 
+fitsDown(const int *cellWidths, int count, int lineWidth, int cols)
+{
+	int rows, col, lo, hi, lineLen;
+
+	rows = (count + cols - 1) / cols;
+	lineLen = cols * MIN_COLUMN_WIDTH;
+	for (col = 0; col < cols; col++) {
+		lo = col * rows;
+		hi = (lo + rows < count) ? lo + rows : count;
+		colWidths[col] = columnWidth(lo < hi ? rangeMax(cellWidths, lo, hi) : 0, col, cols);
+
+		// like GNU ls, a line is only checked once a column grew
+		if (colWidths[col] > MIN_COLUMN_WIDTH) {
+			lineLen += colWidths[col] - MIN_COLUMN_WIDTH;
+			if (lineLen >= lineWidth) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+// returns 1 and fills colWidths if cols columns filled left to right fit
+static int 
+fitsAcross(const int *cellWidths, int count, int lineWidth, int cols)
+{
+	int i, col, width, lineLen;
+
+	lineLen = cols * MIN_COLUMN_WIDTH;
+	for (col = 0; col < cols; col++) {
+		colWidths[col] = MIN_COLUMN_WIDTH;
+	}
+
+	for (i = 0; i < count; i++) {
+		col = i % cols;
+		width = columnWidth(cellWidths[i], col, cols);
+		if (colWidths[col] < width) {
+			lineLen += width - colWidths[col];
+			colWidths[col] = width;
+			if (lineLen >= lineWidth) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+// fill layout with the densest arrangement of count cells of the given
+// widths in lineWidth characters; across = 1 fills rows first (-x),
+// otherwise columns first (-C)
+// layout->widths holds the width of each column including the separator,
+// except for the last column, and is valid until the next call
+void 
+computeLayout(const int *cellWidths, int count, int lineWidth, int across, struct layout *layout)
+{
+	int maxCols, cols;
+
+	maxCols = lineWidth / MIN_COLUMN_WIDTH + (lineWidth % MIN_COLUMN_WIDTH != 0);
+	if (maxCols > count) {
+		maxCols = count;
+	}
+	if (maxCols < 1) {
+		maxCols = 1;
+	}
+
+	colWidths = growInts(colWidths, &colWidthsSize, maxCols);
+	if (across == 0) {
+		computeBlockMax(cellWidths, count);
+	}
+
+	// one column always has to do, even if a name is wider than the line
+	for (cols = maxCols; cols > 1; cols--) {
+		if (across ? fitsAcross(cellWidths, count, lineWidth, cols) : fitsDown(cellWidths, count, lineWidth, cols)) {
+			break;
+		}
+	}
+
+	if (cols == 1) {
+		colWidths[0] = columnWidth(0, 0, 1);
+	}
+
+	layout->cols = cols;
+	layout->rows = (count + cols - 1) / cols;
+	layout->widths = colWidths;
+}
@@ -9,34 +9,22 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <fts.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
-#include <bsd/string.h>
-#include <pwd.h>
-#include <grp.h>
 #include <time.h>
 #include <limits.h>
 #include <sys/ioctl.h>
+#include <getopt.h>
 
-#define NOFLAG 0
-#define FLAG_d 1
-#define FLAG_a 2
-#define FLAG_A 3
-#define FLAG_f 4
-#define FLAG_S 5
-#define FLAG_c 6
-#define FLAG_u 7
-
-#define FILE_ATIME 100
-#define FILE_MTIME 101
-#define FILE_CTIME 102
+#include "ls.h"
 
 const int FTS_PATH = 0;
 const int FTS_NAME = 1;
-const int LINKED_TO = 2;
 
 const int IS_DIR = 1;
 const int NOT_DIR = 0;
@@ -44,17 +32,13 @@ const int NOT_DIR = 0;
 const int IS_FIRST = 1;
 const int NOT_FIRST = 0;
 
-const int GET_MAX_WIDTHS = 1;
-const int PRINT_FILES = 2;
-
 const char *progname;
 
-struct winsize w;
-int currentNameColumn, currentPathColumn;
+int lineWidth;
 
 int flagR, flaga, flagA, flagd;
 int flag1, flagl, flagn;
-int flagC;
+int flagC, flagx;
 int flagt, flagS, flagr;
 int flagi;
 int flagF;
@@ -66,9 +50,47 @@ int flagh;
 int flagq;
 int flagw;
 
+int outputMode;
+
+// long options have values past the single character ones, in the order
+// of longOptions
+#define OPT_STATS 256
+#define OPT_ZERO 257
+#define OPT_JSON 258
+#define OPT_BINARY 259
+#define OPT_WATCH 260
+#define OPT_DU 261
+#define OPT_NAME 262
+#define OPT_REGEX 263
+#define OPT_TYPE 264
+#define OPT_SIZE 265
+#define OPT_TIME 266
+#define OPT_TOP 267
+
+static const struct option longOptions[] = {
+	{"stats", no_argument, NULL, OPT_STATS},
+	{"zero", no_argument, NULL, OPT_ZERO},
+	{"json", no_argument, NULL, OPT_JSON},
+	{"binary", no_argument, NULL, OPT_BINARY},
+	{"watch", no_argument, NULL, OPT_WATCH},
+	{"du", no_argument, NULL, OPT_DU},
+	{"name", required_argument, NULL, OPT_NAME},
+	{"regex", required_argument, NULL, OPT_REGEX},
+	{"type", required_argument, NULL, OPT_TYPE},
+	{"size", required_argument, NULL, OPT_SIZE},
+	{"time", required_argument, NULL, OPT_TIME},
+	{"top", required_argument, NULL, OPT_TOP},
+	{NULL, 0, NULL, 0}
+};
+
 int sortFlag;
 int timeFlag;
 
+// 1 once an entry or directory could not be read; listing goes on
+int exitStatus;
+
+int metaDemand;
+
 int maxWidthFileInode;
 int maxWidthFileBlocks;
 int maxWidthFileLink;
@@ -77,27 +99,39 @@ int maxWidthFileGroupname;
 int maxWidthFileSize;
 int maxWidthFileMajor;
 int maxWidthFileMinor;
-int maxWidthFileName;
-int maxWidthFilePath;
 blkcnt_t fileTotalSystemBlocks;
 
 
-FTS * getFileHierarchy(char **, int);
-int entcmp(const FTSENT **, const FTSENT **);
+int entrycmp(const void *, const void *);
+void sortOperands(struct entrylist *);
 int cmpLexicograph(const void *, const void *);
 
-void initMaxWidthFiles();
-void updateMaxWidthFiles(FTSENT *);
+void measureEntries(struct entrylist *);
 
-void handleFiles(char **, int, int, int); 
-void handleFlagRecursive(char **, int); 
-void handleFlagNonRecursive(char **, int, int, int);
+void computeMetaDemand();
 
-void print(FTSENT *, int, int, int);
-void printFlag1(FTSENT *, int, int, int);
-void printFlagln(FTSENT *, int, int, int);
-void printFlagC(FTSENT *, int, int, int);
-void printDefault(FTSENT *, int, int, int);
+void initMaxWidthFiles();
+void updateMaxWidthFiles(struct entry *);
+
+void handleFiles(struct entrylist *); 
+void handleFlagRecursive(struct entrylist *); 
+void listTree(char *, int, char *, int *, struct subtree *);
+void printTree(struct dirnode *, int *, struct subtree *);
+void printDirectory(char *, struct entrylist *, int, int *);
+char *joinPath(const char *, const char *);
+void handleFlagNonRecursive(struct entrylist *, int);
+int canStream();
+void printStreamed(struct entry *);
+
+void print(struct entry *, int, int, int);
+void printEntries(struct entrylist *, int);
+void printColumns(struct entrylist *, int);
+int cellWidth(struct entry *, int);
+int terminalWidth();
+void printFlag1(struct entry *, int, int, int);
+void printFlagln(struct entry *, int, int, int);
+void printFlagC(struct entry *, int, int, int);
+void printDefault(struct entry *, int, int, int);
 void printInode(struct stat *);
 void printBlocks(struct stat *);
 void printMode(struct stat *);
@@ -105,21 +139,26 @@ void printUid(struct stat *, int);
 void printGid(struct stat *, int);
 void printSize(struct stat *, int, int, int);
 void printDate(struct stat *);
-void printNameWithLinkedToFile(FTSENT *, int, int);
-void printName(char *, int, int);
-void printFilename(char *, int, int);
+void printNameWithLinkedToFile(struct entry *, int);
+void printName(char *);
+char *displayName(char *, size_t *);
 void printFileTypeSuffix(struct stat *);
+char fileTypeSuffix(struct stat *);
+int linkAt(struct entry *, int, char **);
+void setLinkDir(char *, int, int, char *);
+void closeLinkDir();
+int statLinkTarget(struct entry *, int, struct stat *);
+long long scaledBlocks(struct stat *);
 void printTotalSystemBlocks();
-void humanizeFilesize(long long, char *, int);
-void replaceNonPrintableChar(char *);
-void leftAllign(char *);
 
 int main(int argc, char **argv)
 {
+	char *endptr;
 	int ch;
 
 	progname = argv[0];
-	ioctl(0, TIOCGWINSZ, &w);
+	initOutput();
+	lineWidth = terminalWidth();
 
 	sortFlag = NOFLAG;
 	timeFlag = FILE_MTIME;
@@ -137,7 +176,7 @@ int main(int argc, char **argv)
 	}
 
 	// parse options
-	while ((ch = getopt(argc, argv, "AaCcdFfhiklnqRrSstuwx1")) != -1) {
+	while ((ch = getopt_long(argc, argv, "AaCcdFfhiklnqRrSstuwx1", longOptions, NULL)) != -1) {
 		switch (ch) {
 			case 'A':
 				flagA = 1;
@@ -151,9 +190,11 @@ int main(int argc, char **argv)
 				break;
 			case 'C':
 				flagC = 1;
+				flagx = 0;
 				flagl = 0;
 				flagn = 0;
 				flag1 = 0;
+				break;
 			case 'c':
 				timeFlag = FILE_CTIME;
 				break;
@@ -221,6 +262,7 @@ int main(int argc, char **argv)
 				break;
 			case 'x':
 				flagC = 1;
+				flagx = 1;
 				flagl = 0;
 				flagn = 0;
 				flag1 = 0;
@@ -231,8 +273,43 @@ int main(int argc, char **argv)
 				flagn = 0;
 				flagC = 0;
 				break;
+			case OPT_STATS:
+				enableStats();
+				break;
+			case OPT_ZERO:
+				outputMode = OUTPUT_ZERO;
+				break;
+			case OPT_JSON:
+				outputMode = OUTPUT_JSON;
+				break;
+			case OPT_BINARY:
+				outputMode = OUTPUT_BINARY;
+				break;
+			case OPT_WATCH:
+				watchMode = 1;
+				break;
+			case OPT_DU:
+				duMode = 1;
+				break;
+			case OPT_NAME:
+			case OPT_REGEX:
+			case OPT_TYPE:
+			case OPT_SIZE:
+			case OPT_TIME:
+				if (addPredicate(FILTER_NAME + ch - OPT_NAME, optarg) == -1) {
+					fprintf(stderr, "%s: invalid argument to --%s: %s\n", progname, longOptions[ch - OPT_STATS].name, optarg);
+					exit(1);
+				}
+				break;
+			case OPT_TOP:
+				topCount = strtol(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || topCount < 1) {
+					fprintf(stderr, "%s: invalid argument to --top: %s\n", progname, optarg);
+					exit(1);
+				}
+				break;
 			default:
-				fprintf(stderr, "usage: %s [-AaCcdfhiklnqRrSstuwx1] [file ...]\n",progname);
+				fprintf(stderr, "usage: %s [-AaCcdfhiklnqRrSstuwx1] [--stats] [--zero | --json | --binary] [--watch] [--du] [--name glob] [--regex re] [--type fdlcbps] [--size range] [--time range] [--top n] [file ...]\n",progname);
 				exit(1); 
 		}
 	}
@@ -242,109 +319,93 @@ int main(int argc, char **argv)
 	} else if (flagt == 1) {
 		sortFlag = timeFlag;
 	} 
+
+	// --top prints only the entries it keeps, no subtree totals
+	if (topCount > 0) {
+		duMode = 0;
+	}
+
+	initFilter((flaga == 1) ? FLAG_a : (flagA == 1) ? FLAG_A : NOFLAG, flagR);
+	computeMetaDemand();
+	initMeta();
+	openCache();
+	startRecords();
+	if (watchMode) {
+		initWatch(flagR);
+	}
 	
 	argc -= optind;
 	argv += optind;
 
 	// separate files and dirs
-	char **files;
-	char **dirs;
-	struct stat sb;
-	int fileCount;
-	int dirCount;
+	struct entrylist files;
+	struct entrylist dirs;
+	struct stat *stats;
 	int i;
 
-	fileCount = 0;
-	dirCount = 0;
-	
+	initEntryList(&files);
+	initEntryList(&dirs);
+
+	// operands are lstat'ed once here; the stat buffers are reused for
+	// printing and for sorting the directories
+	if ((stats = malloc((argc > 0 ? argc : 1) * sizeof(struct stat))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
 
 	if (argc == 0) {
-		if ((dirs = malloc(2 * sizeof(char *))) == NULL) {
-			perror("malloc");
-			exit(1);
-		}
-		dirs[0] = ".";
-		dirs[1] = NULL;
-		dirCount = 1;
-	} else {
-		if ((files = malloc((argc + 1) * sizeof(char *))) == NULL) {
-			perror("malloc");
+		if (fetchMeta(AT_FDCWD, ".", &stats[0]) == -1) {
+			perror("lstat:");
 			exit(1);
 		}
 
-		if ((dirs  = malloc((argc + 1) * sizeof(char *))) == NULL) {
-			perror("malloc");
-			exit(1);
+		if (flagd == 1) {
+			addEntry(&files, ".", ".", &stats[0]);
+		} else {
+			addEntry(&dirs, ".", ".", &stats[0]);
 		}
-
+	} else {
 		for (i=0; i<argc; i++) {
-			if (lstat(argv[i], &sb) == -1) {
+			if (fetchMeta(AT_FDCWD, argv[i], &stats[i]) == -1) {
 				perror("lstat:");
 				exit(1);
 			}
 	
-			if (S_ISDIR(sb.st_mode)) {
-				dirs[dirCount] = argv[i];
-				dirCount++;	
+			if (S_ISDIR(stats[i].st_mode) && flagd == 0) {
+				addEntry(&dirs, argv[i], argv[i], &stats[i]);
 			} else {
-				files[fileCount] = argv[i];
-				fileCount++;
+				addEntry(&files, argv[i], argv[i], &stats[i]);
 			}
 		}
+	}
 
-		files[fileCount] = NULL;
-		dirs[dirCount] = NULL;
+	if (files.count > 0) {
+		handleFiles(&files);
 	}
 
-	
-	if (flagd == 1) {
-		if (argc == 0) {
-			handleFiles(dirs, dirCount, GET_MAX_WIDTHS, FLAG_d);
-			handleFiles(dirs, dirCount, PRINT_FILES, FLAG_d);
-		} else {
-			qsort(argv, argc, sizeof(argv[0]), cmpLexicograph);
-			handleFiles(argv, argc, GET_MAX_WIDTHS, FLAG_d);
-			handleFiles(argv, argc, PRINT_FILES, FLAG_d);
-		}
-	} else {
-		if (fileCount > 0) {
-			qsort(files, fileCount, sizeof(files[0]), cmpLexicograph);
-			handleFiles(files, fileCount, GET_MAX_WIDTHS, NOFLAG);
-			handleFiles(files, fileCount, PRINT_FILES, NOFLAG);
+	if (dirs.count > 0) {
+		if (files.count > 0 && outputMode == OUTPUT_TEXT) {
+			outNewline();
 		}
 
-		if (dirCount > 0) {
-			if (fileCount > 0) {
-				printf("\n");
-			}
-
-			qsort(dirs, dirCount, sizeof(dirs[0]), cmpLexicograph);
-			
-			if (flagR == 1) {
-				if (flaga == 1) {
-					handleFlagRecursive(dirs, FLAG_a); 
-				} else if (flagA == 1) {
-					handleFlagRecursive(dirs, FLAG_A);
-				} else {
-					handleFlagRecursive(dirs, NOFLAG);
-				}
-
-			} else { // R = 0 ; non-recursive
-				if (flaga == 1) {
-					handleFlagNonRecursive(dirs, dirCount, fileCount, FLAG_a);
-				} else if (flagA == 1) {
-					handleFlagNonRecursive(dirs, dirCount, fileCount, FLAG_A);
-				} else {
-					handleFlagNonRecursive(dirs, dirCount, fileCount, NOFLAG);
-				}
-			}
+		sortOperands(&dirs);
+		
+		if (flagR == 1) {
+			handleFlagRecursive(&dirs);
+		} else { // R = 0 ; non-recursive
+			handleFlagNonRecursive(&dirs, files.count);
 		}
 	}
 
-	if (flagC == 1) {
-		printf("\n");
+	flushOutput();
+	saveCache();
+	if (watchMode) {
+		runWatch();
 	}
-	exit(0);
+	if (statsEnabled) {
+		printStats();
+	}
+	exit(exitStatus);
 }
 
 int 
@@ -357,140 +418,164 @@ cmpLexicograph(const void *p1, const void *p2)
 }
 
 int 
-entcmp(const FTSENT **a, const FTSENT **b)
+entrycmp(const void *p1, const void *p2)
 {
-	const char *s1, *s2; 
-	off_t sz1, sz2;
-	time_t time1, time2;
-	
-	switch (sortFlag) {
-		case NOFLAG:
-			s1 = (*a)->fts_name;
-			s2 = (*b)->fts_name;
-			return (flagr == 1) ? strcasecmp(s2, s1) : strcasecmp(s1, s2);
-		case FLAG_S:
-			sz1 = (*a) -> fts_statp -> st_size;
-			sz2 = (*b) -> fts_statp -> st_size;
-			return (flagr == 1) ? sz1 - sz2 : sz2 - sz1;
-		case FILE_ATIME:
-			time1 = (*a) -> fts_statp -> st_atime;
-			time2 = (*b) -> fts_statp -> st_atime;
-			return (flagr == 1) ? time1 - time2 : time2 - time1;
-		case FILE_MTIME:
-			time1 = (*a) -> fts_statp -> st_mtime;
-			time2 = (*b) -> fts_statp -> st_mtime;
-			return (flagr == 1) ? time1 - time2 : time2 - time1;
-		case FILE_CTIME:
-			time1 = (*a) -> fts_statp -> st_ctime;
-			time2 = (*b) -> fts_statp -> st_ctime;
-			return (flagr == 1) ? time1 - time2 : time2 - time1;
-	}
+	const struct entry *a = p1;
+	const struct entry *b = p2;
 
-	fprintf(stderr, "problem with sorting\n");
-	return 0;
+	return cmpLexicograph(&a->name, &b->name);
 }
 
-// dispFlag = {NOFLAG, FLAG_f}
-// flag = {NOFLAG, FLAG_A, FLAG_a}
-FTS * 
-getFileHierarchy(char **files, int flag)
+// operands are listed in argument order under -f, but still sorted by name
+void 
+sortOperands(struct entrylist *list)
 {
-	FTS *tree;
-	tree = NULL;
-
-	switch(sortFlag) {
-		case FLAG_f:
-			switch(flag) {
-				case NOFLAG:
-				case FLAG_A:
-					tree = fts_open(files, FTS_PHYSICAL, NULL);
-					break;
-				case FLAG_a:
-					tree = fts_open(files, FTS_PHYSICAL | FTS_SEEDOT, NULL);
-					break;
-			}
-			break;
-		default:
-			switch(flag) {
-				case NOFLAG:
-				case FLAG_A:
-					tree = fts_open(files, FTS_PHYSICAL, entcmp);
-					break;
-				case FLAG_a:
-					tree = fts_open(files, FTS_PHYSICAL | FTS_SEEDOT, entcmp);
-					break;
-			}
+	if (sortFlag == FLAG_f) {
+		qsort(list->entries, list->count, sizeof(struct entry), entrycmp);
+	} else {
+		sortEntries(list);
 	}
+}
 
-	if (tree == NULL) {
-		perror("fts_open");
-		exit(1);
-	} 
+void 
+initEntryList(struct entrylist *list)
+{
+	memset(list, 0, sizeof(struct entrylist));
+}
 
-	return tree;	
+void 
+freeEntryList(struct entrylist *list)
+{
+	free(list->entries);
+	free(list->names);
+	free(list->stats);
+	initEntryList(list);
 }
 
+void 
+addEntry(struct entrylist *list, char *name, char *path, struct stat *sb)
+{
+	struct entry *e;
+
+	if (list->count == list->size) {
+		list->size = (list->size == 0) ? 64 : list->size * 2;
+		if ((list->entries = realloc(list->entries, list->size * sizeof(struct entry))) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	e = &list->entries[list->count++];
+	e->name = name;
+	e->path = path;
+	e->sb = sb;
+	e->type = DT_UNKNOWN;
+}
 
+// the entries are the ones listed, filter.c has dropped the others
 void 
-handleFiles(char **files, int fileCount, int action, int flag) 
+measureEntries(struct entrylist *list)
 {
-	FTS *tree;
-	FTSENT *f;
+	int i;
 
-	if (fileCount > 0) {
-		tree = getFileHierarchy(files, NOFLAG);
+	initMaxWidthFiles();
 
-		if (action == GET_MAX_WIDTHS) {
-			initMaxWidthFiles();
+	for (i = 0; i < list->count; i++) {
+		updateMaxWidthFiles(&list->entries[i]);
+	}
+}
 
-			if (flag == NOFLAG) {
-				while ((f = fts_read(tree)) != NULL) {
-					updateMaxWidthFiles(f);
-				}
-			}
- 
-			if (flag == FLAG_d) {
-				while ((f = fts_read(tree)) != NULL) {
-					if (f->fts_info == FTS_DP) {
-						fts_set(tree, f, FTS_SKIP);
-						continue;
-					}
-					updateMaxWidthFiles(f);
-					fts_set(tree, f, FTS_SKIP);
-				}
-			}
-		} 
- 
+// work out which stat fields the active flags use
+void 
+computeMetaDemand()
+{
+	metaDemand = 0;
 
-		if (action == PRINT_FILES){
-			if (flag == NOFLAG) {
-				while ((f = fts_read(tree)) != NULL) {
-					print(f, FTS_PATH, NOT_DIR, NOT_FIRST);
-				}
-			} 
-
-			if (flag == FLAG_d) {
-				while ((f = fts_read(tree)) != NULL) {
-					if (f->fts_info == FTS_DP) {
-						fts_set(tree, f, FTS_SKIP);
-						continue;
-					}
-					print(f, FTS_PATH, NOT_DIR, NOT_FIRST);
-					fts_set(tree, f, FTS_SKIP);
-				}
-			}
-		} 
+	if (flagl == 1 || flagn == 1 || outputMode == OUTPUT_JSON || outputMode == OUTPUT_BINARY) {
+		metaDemand = META_ALL;
+	}
 
-		if (f == NULL && errno != 0) {
-			perror("fts_read");
-			exit(1);
-		}
+	if (flagi == 1) {
+		metaDemand |= META_INO;
+	}
 
-		if (fts_close(tree) == -1) {
-			fprintf(stderr, "error: fts_close\n");
-			exit(1);
+	if (flags == 1) {
+		metaDemand |= META_BLOCKS;
+	}
+
+	if (flagF == 1) {
+		metaDemand |= META_TYPE | META_MODE;
+	}
+
+	if (flagR == 1) {
+		metaDemand |= META_TYPE;
+	}
+
+	// hard links are counted once, by (dev, ino), if nlink is above 1
+	if (flagR == 1 && duMode == 1) {
+		metaDemand |= META_BLOCKS | META_SIZE | META_NLINK | META_INO;
+	}
+
+	metaDemand |= filterDemand();
+
+	if (sortFlag == FLAG_S) {
+		metaDemand |= META_SIZE;
+	} else if (sortFlag == FILE_ATIME || sortFlag == FILE_MTIME || sortFlag == FILE_CTIME) {
+		metaDemand |= META_TIME;
+	}
+}
+
+// returns 1 if an entry of the given d_type has to be stat'ed
+int 
+needStat(unsigned char type)
+{
+	int demand;
+
+	demand = metaDemand;
+	if (type != DT_UNKNOWN) {
+		demand &= ~META_TYPE;
+
+		// -F only looks at the permission bits of regular files
+		if (type != DT_REG) {
+			demand &= ~META_MODE;
 		}
 	}
+
+	return demand != 0;
+}
+
+// stat of an entry that was not stat'ed: only the file type is known
+void 
+fillTypeStat(struct stat *sb, unsigned char type)
+{
+	memset(sb, 0, sizeof(struct stat));
+	sb->st_mode = DTTOIF(type);
+}
+
+void 
+handleFiles(struct entrylist *files) 
+{
+	if (files->count > 0) {
+		sortOperands(files);
+		printFileEntries(files);
+	}
+}
+
+// entries listed by their paths, in the order they are in
+void 
+printFileEntries(struct entrylist *files)
+{
+	int i, phase;
+
+	phase = enterPhase(PHASE_FORMAT);
+	initMaxWidthFiles();
+	for (i = 0; i < files->count && outputMode == OUTPUT_TEXT; i++) {
+		updateMaxWidthFiles(&files->entries[i]);
+	}
+
+	printEntries(files, FTS_PATH);
+	resetArena();
+	enterPhase(phase);
 }
 
 void 
@@ -504,60 +589,38 @@ initMaxWidthFiles()
 	maxWidthFileSize = 0;
 	maxWidthFileMajor = 0;
 	maxWidthFileMinor = 0;
-	maxWidthFileName = 0;
-	maxWidthFilePath = 0;
-	currentNameColumn = 0;
-	currentPathColumn = 0;
 	fileTotalSystemBlocks = 0;
 }
 
 
 void
-updateMaxWidthFiles(FTSENT *f)
+updateMaxWidthFiles(struct entry *e)
 {
 	int width;
-	char str[100];
-
-	struct passwd *userInfo;
-	struct group *groupInfo;
 
 	// get max width of inode
-	memset(str, 0, 100);
-	snprintf(str, 100, "%lld", (long long) (f -> fts_statp -> st_ino));
-	width = strlen(str);
+	width = countDigits(e->sb->st_ino);
 	if (maxWidthFileInode < width) {
 		maxWidthFileInode = width;
 	}
 
 	// get max with of blocks
-	memset(str, 0, 100);
-	snprintf(str, 100, "%lld", (long long) (f -> fts_statp -> st_blocks));
-	width = strlen(str);
+	width = countDigits(e->sb->st_blocks);
 	if (maxWidthFileBlocks < width) {
 		 maxWidthFileBlocks = width;
 	}
 
 	// get max width of links
-	memset(str, 0, 100);
-	snprintf(str, 100, "%ld", (long)(f->fts_statp->st_nlink));
-	width = strlen(str);
+	width = countDigits(e->sb->st_nlink);
 	if (maxWidthFileLink < width) {
 		maxWidthFileLink = width;
 	}
 
 	// get max width of username
 	if (flagl == 1) {
-		if((userInfo = getpwuid(f->fts_statp->st_uid)) != NULL) {
-			width = strlen(userInfo->pw_name);
-		} else {
-			memset(str, 0, 100);
-			snprintf(str, 100, "%d", f->fts_statp->st_uid);
-			width = strlen(str);
-		}
+		userName(e->sb->st_uid, &width);
 	} else if (flagn == 1) {
-		memset(str, 0, 100);
-		snprintf(str, 100, "%d", f->fts_statp->st_uid);
-		width = strlen(str);
+		width = countDigits(e->sb->st_uid);
 	}
 	
 	if (maxWidthFileUsername < width) {
@@ -566,17 +629,9 @@ updateMaxWidthFiles(FTSENT *f)
 
 	// get max width of groupname
 	if (flagl == 1) {
-		if((groupInfo = getgrgid(f->fts_statp->st_gid)) != NULL) {
-			width = strlen(groupInfo->gr_name);
-		} else {
-			memset(str, 0, 100);
-			snprintf(str, 100, "%d", f->fts_statp->st_gid);
-			width = strlen(str);
-		}
+		groupName(e->sb->st_gid, &width);
 	} else if (flagn == 1) {
-		memset(str, 0, 100);
-		snprintf(str, 100, "%d", f->fts_statp->st_gid);
-		width = strlen(str);
+		width = countDigits(e->sb->st_gid);
 	}
 
 	if (maxWidthFileGroupname < width) {
@@ -584,461 +639,692 @@ updateMaxWidthFiles(FTSENT *f)
 	}
 
 	// get max width of size
-	memset(str, 0, 100);
-	snprintf(str, 100, "%lld", (long long) (f->fts_statp->st_size));
-	width = strlen(str);
-
+	width = countDigits(e->sb->st_size);
 	if (maxWidthFileSize < width) {
 		maxWidthFileSize = width;
 	}
 	
-	if (S_ISCHR(f->fts_statp->st_mode) || S_ISBLK(f->fts_statp->st_mode)) {
+	if (S_ISCHR(e->sb->st_mode) || S_ISBLK(e->sb->st_mode)) {
 		// get max width of major
-		memset(str, 0, 100);
-		snprintf(str, 100, "%d", major(f->fts_statp->st_rdev));
-		width = strlen(str);
-
+		width = countDigits(major(e->sb->st_rdev));
 		if (maxWidthFileMajor < width) {
 			maxWidthFileMajor = width;
 		}
 
 		// get max width of minor
-		memset(str, 0, 100);
-		snprintf(str, 100, "%d", minor(f->fts_statp->st_rdev));
-		width = strlen(str);
-
+		width = countDigits(minor(e->sb->st_rdev));
 		if (maxWidthFileMinor < width) {
 			maxWidthFileMinor = width;
 		}
 	}
 
-	// get max width of filename
-	width = strlen(f -> fts_name);
-	if (maxWidthFileName < width) {
-		maxWidthFileName = width;
-	}
-
-	// get max width of filepath	
-	width = strlen(f -> fts_path);
-	if (maxWidthFilePath < width) {
-		maxWidthFilePath = width;
-	}
-
 	// get total system blocks
-	fileTotalSystemBlocks += f->fts_statp->st_blocks;
+	fileTotalSystemBlocks += e->sb->st_blocks;
 
 }
 
 // R = 1
-void handleFlagRecursive(char **dirs, int flag) 
+// dirs are expected to be sorted already
+void handleFlagRecursive(struct entrylist *dirs) 
 {
-	FTS *tree;
-	FTSENT *f1, *f2;
-	FTSENT *temp;
-	int i;
-
-	tree = getFileHierarchy(dirs, flag);
-	
-	i = 0;
-	while ((f1 = fts_read(tree)) != NULL) {
-		
-		if (f1->fts_info == FTS_DP) {
-			continue;
-		}
-
-		if (flag == NOFLAG) {
-			// skip hidden files
-			if (f1->fts_name[0] == '.' && strcmp(f1->fts_name, f1->fts_path) != 0) {
-				fts_set(tree, f1, FTS_SKIP);
-				continue;
-			}
-		}
-
-		if (f1->fts_info == FTS_D) {
-			if (i == 0) {
-				print(f1, FTS_PATH, IS_DIR, IS_FIRST);
-				i = 1;
-			} else {
-				print(f1, FTS_PATH, IS_DIR, NOT_FIRST);
-			}
-			f2 = fts_children(tree, 0);
-			
-			temp = f2;
-			initMaxWidthFiles();
-			while (temp != NULL) {
-				if (temp -> fts_name[0] != '.') {
-					updateMaxWidthFiles(temp);
-				}
-				temp = temp -> fts_link;
-			}
-
-			if (flagl == 1 || flagn == 1 || (flags == 1 && isatty(fileno(stdout)))) {
-				printTotalSystemBlocks();
-			}
+	struct dirnode **roots;
+	struct subtree total;
+	int i, isFirst, threads;
 
-			if (flag == FLAG_a || flag == FLAG_A) {
-				while (f2 != NULL) {
-					print(f2, FTS_NAME, NOT_DIR, NOT_FIRST);
-					f2 = f2 -> fts_link;
-				}
-			}
+	isFirst = IS_FIRST;
 
-			if (flag == NOFLAG) {
-				while (f2 != NULL) {
-					if (f2->fts_name[0] != '.') {
-						print(f2, FTS_NAME, NOT_DIR, NOT_FIRST);
-					}
-					f2 = f2 -> fts_link;
-				}
-			}
+	if ((threads = walkThreads()) <= 1) {
+		for (i = 0; i < dirs->count; i++) {
+			startSubtree(&total, dirs->entries[i].sb);
+			listTree(dirs->entries[i].path, -1, dirs->entries[i].path, &isFirst, duMode ? &total : NULL);
 		}
+		printTop();
+		return;
 	}
 
-	if (f1 == NULL && errno != 0) {
-		perror("fts_read");
-		exit(1);
-	}
-
-	if (fts_close(tree) == -1) {
-		fprintf(stderr, "error: fts_close\n");
-		exit(1);
+	roots = startWalk(dirs, threads);
+	for (i = 0; i < dirs->count; i++) {
+		startSubtree(&total, dirs->entries[i].sb);
+		printTree(roots[i], &isFirst, duMode ? &total : NULL);
 	}
+	stopWalk();
+	free(roots);
+	printTop();
 }
 
-
+// list a directory, then its subdirectories depth first in listing order
+// the directory is opened as name, the tail of path, relative to the
+// closest open ancestor parentFd (-1: name is the whole path); it stays
+// open for its own subdirectories while fds are left, else they are
+// opened relative to parentFd as well
+// total: --du totals of the directory, started with its own inode
 void 
-handleFlagNonRecursive(char **dirs, int dirCount, int fileCount, int flag)
+listTree(char *path, int parentFd, char *name, int *isFirst, struct subtree *total)
 {
-	FTS *tree;
-	FTSENT *f1, *f2;
-	int i;
-	FTSENT *temp;
+	struct entry *e;
+	struct entrylist list;
+	struct subtree *childTotals;
+	char *child;
+	int j, k, fd, error, childFd;
+	size_t offset;
 
-	if (dirCount <= 0) {
-		return;
+	initEntryList(&list);
+	error = 0;
+	if ((fd = openDirectory(parentFd, name, path)) == -1 || readDirectory(fd, path, &list) == -1) {
+		error = errno;
 	}
 
-	tree = getFileHierarchy(dirs, flag);
+	// --top picks its entries from the whole walk, in any order
+	if (topCount == 0) {
+		sortEntries(&list);
+	}
 
-	i = 0;
-	while ((f1 = fts_read(tree)) != NULL) {
-		
-		if (f1->fts_info == FTS_DP){
-			continue;
-		}
- 
-		if (dirCount > 1 || fileCount > 0) {
-			print(f1, FTS_PATH, IS_DIR, IS_FIRST);
-		}
-		
-		f2 = fts_children(tree, 0);
+	setLinkDir(path, fd, -1, NULL);
+	printDirectory(path, &list, error, isFirst);
 
-		temp = f2;
-		initMaxWidthFiles();
+	childTotals = NULL;
+	if (total != NULL) {
+		childTotals = countEntries(total, &list);
+	}
 
-		if (flag == FLAG_A || flag == FLAG_a) {
-			while (temp != NULL) {
-				updateMaxWidthFiles(temp);
-				temp = temp -> fts_link;
-			}
-		}
+	if (fd != -1 && !holdDirFd()) {
+		close(fd);
+		countStat(STAT_CLOSE, 1);
+		fd = -1;
+	}
 
-		if (flag == NOFLAG) {
-			while (temp != NULL) {
-				if (temp -> fts_name[0] != '.') {
-					updateMaxWidthFiles(temp);
-				}
-				temp = temp -> fts_link;
-			}
+	// where the name of a child relative to childFd starts in its path
+	if (fd != -1) {
+		childFd = fd;
+		offset = strlen(path);
+		if (offset > 0 && path[offset - 1] == '/') {
+			offset--;
 		}
+		offset++;
+	} else {
+		childFd = parentFd;
+		offset = name - path;
+	}
 
-		if (flagl == 1 || flagn == 1 || (flags == 1 && isatty(fileno(stdout)))) {
-			printTotalSystemBlocks();
-		}
-		if (flag == FLAG_a || flag == FLAG_A) {
-			while (f2 != NULL) {
-				print(f2, FTS_NAME, NOT_DIR, i);
-				fts_set(tree, f2, FTS_SKIP);
-				f2 = f2->fts_link;
-			}
+	// directories the predicates dropped are walked after the others
+	k = 0;
+	for (j = 0; j < list.count + list.walkOnly; j++) {
+		e = &list.entries[j];
+		if (!S_ISDIR(e->sb->st_mode) || strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) {
+			continue;
 		}
 
-		if (flag == NOFLAG) {
-			while (f2 != NULL) {
-				// skip hidden files
-				if (f2->fts_name[0] == '.' && strcmp(f2->fts_name, ".") != 0 && strcmp(f2->fts_name, "..") != 0) {
-					fts_set(tree, f1, FTS_SKIP);
-					f2 = f2 -> fts_link;
-					continue;
-				}
-				print(f2, FTS_NAME, NOT_DIR, i);
-				fts_set(tree, f2, FTS_SKIP);
-				f2 = f2->fts_link;
-			}
+		child = joinPath(path, e->name);
+		if (total != NULL) {
+			listTree(child, childFd, child + offset, isFirst, &childTotals[k]);
+			addSubtree(total, &childTotals[k++]);
+		} else {
+			listTree(child, childFd, child + offset, isFirst, NULL);
 		}
+		free(child);
+	}
+
+	if (total != NULL) {
+		printSubtree(path, total);
+		free(childTotals);
+	}
 
-		fts_set(tree, f1, FTS_SKIP);
+	if (fd != -1) {
+		releaseDirFd(fd);
+	}
+	freeEntryList(&list);
+}
+
+// same order as listTree, the directories are read by the walker threads
+void 
+printTree(struct dirnode *node, int *isFirst, struct subtree *total)
+{
+	struct subtree *childTotals;
+	int j, phase;
+
+	phase = enterPhase(PHASE_WAIT);
+	waitNode(node);
+	enterPhase(phase);
 
-		if (++i < dirCount)
-			printf("\n");
+	// the fd is held for the symlinks if there are any, else the ancestor
+	// to reopen it relative to
+	if (node->linkParent != NULL) {
+		setLinkDir(node->path, -1, node->linkParent->fd, node->name);
+	} else if (node->links) {
+		setLinkDir(node->path, node->fd, -1, node->path);
 	}
+	printDirectory(node->path, &node->list, node->error, isFirst);
 
-	if (f1 == NULL && errno != 0) {
-		perror("fts_read");
-		exit(1);
+	childTotals = NULL;
+	if (total != NULL) {
+		childTotals = countEntries(total, &node->list);
 	}
+	releaseNode(node);
 
-	if (fts_close(tree) == -1) {
-		fprintf(stderr, "error: fts_close\n");
-		exit(1);
+	for (j = 0; j < node->childCount; j++) {
+		if (total != NULL) {
+			printTree(node->children[j], isFirst, &childTotals[j]);
+			addSubtree(total, &childTotals[j]);
+		} else {
+			printTree(node->children[j], isFirst, NULL);
+		}
+	}
+
+	if (total != NULL) {
+		printSubtree(node->path, total);
+		free(childTotals);
 	}
+
+	freeNode(node);
 }
 
+// print one directory of -R: header, total and entries
 void 
-print(FTSENT *f, int isName, int isDir, int isFirst)
+printDirectory(char *path, struct entrylist *list, int error, int *isFirst)
 {
-	if (flag1 == 1) {
-		printFlag1(f, isName, isDir, isFirst);
-	} else if(flagl == 1 || flagn == 1) { 
-		printFlagln(f, isName, isDir, isFirst);
-	} else if (flagC == 1) {
-		printFlagC(f, isName, isDir, isFirst);
+	struct entry dir;
+	int phase;
+
+	// --top lists nothing until the walk is done
+	if (topCount > 0) {
+		if (error != 0) {
+			fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(error));
+			exitStatus = 1;
+		} else {
+			watchDirectory(path);
+		}
+		offerTop(list);
+		return;
+	}
+
+	phase = enterPhase(PHASE_FORMAT);
+	dir.name = path;
+	dir.path = path;
+	dir.sb = NULL;
+	print(&dir, FTS_PATH, IS_DIR, *isFirst);
+	*isFirst = NOT_FIRST;
+
+	if (error != 0) {
+		fprintf(stderr, "%s: %s: %s\n", progname, path, strerror(error));
+		exitStatus = 1;
 	} else {
-		printDefault(f, isName, isDir, isFirst);
+		watchDirectory(path);
+	}
+
+	if (outputMode == OUTPUT_TEXT) {
+		measureEntries(list);
+
+		if (flagl == 1 || flagn == 1 || (flags == 1 && isatty(fileno(stdout)))) {
+			printTotalSystemBlocks();
+		}
 	}
+
+	printEntries(list, FTS_NAME);
+	closeLinkDir();
+	resetArena();
+	enterPhase(phase);
 }
 
+// --du totals of the subtree at path, after its last directory; in the
+// units of the total line
 void 
-replaceNonPrintableChar(char *fileName)
+printSubtree(char *path, struct subtree *t)
 {
-	while (*fileName != '\0') {
-		if (!isprint(*fileName)) { 
-			*fileName = '?';
-		}
-		fileName++;
+	struct stat sb;
+	char size[5];
+	int phase;
+
+	if (outputMode != OUTPUT_TEXT) {
+		return;
 	}
+
+	phase = enterPhase(PHASE_FORMAT);
+	outNewline();
+	printName(path);
+	outString(": subtree total ");
+	if (flagh == 1) {
+		humanizeSize(t->blocks * 512, size, 5);
+		outString(size + strspn(size, " "));
+		outString(", ");
+		humanizeSize(t->size, size, 5);
+		outString(size + strspn(size, " "));
+	} else {
+		sb.st_blocks = t->blocks;
+		outNumber(scaledBlocks(&sb), 0);
+		outString(", ");
+		outNumber(t->size, 0);
+	}
+	outString(" bytes, ");
+	outNumber(t->dirs, 0);
+	outString(t->dirs == 1 ? " directory, " : " directories, ");
+	outNumber(t->files, 0);
+	outString(t->files == 1 ? " file" : " files");
+	outNewline();
+	enterPhase(phase);
 }
 
-void 
-leftAllign(char *name)
+// parent + "/" + name, without doubling a trailing slash of parent
+char *
+joinPath(const char *parent, const char *name)
 {
-	int len, i;
+	char *path;
+	size_t len;
 
-	len = strlen(name);
-	while (*name == ' ') {
-		for (i = 0; i < len - 1; i++) {
-			name[i] = name[i+1];
-		}
+	len = strlen(parent);
+	if (len > 0 && parent[len - 1] == '/') {
+		len--;
+	}
 
-		for (;i < len; i++) {
-			name[i] = ' ';
-		}
-		name[len] = '\0';
+	if ((path = malloc(len + strlen(name) + 2)) == NULL) {
+		perror("malloc");
+		exit(1);
 	}
 
+	memcpy(path, parent, len);
+	path[len] = '/';
+	strcpy(path + len + 1, name);
+
+	return path;
 }
 
 
-// maxWidth = 0 : don't consider it
-// otherwise consider it
+// dirs are expected to be sorted already
 void 
-printName(char *filename, int maxWidth, int isName)
+handleFlagNonRecursive(struct entrylist *dirs, int fileCount)
 {
-	char *name;
-	char *temp;
-	char ch;
+	struct entry *dir;
+	struct entrylist list;
+	int i, fd, phase;
 
-	if (flagq == 1) {
-		if ((name = malloc((strlen(filename) + 1) * sizeof(char))) == NULL) {
-			perror("malloc");
-			exit(1);
-		}
-		if ((temp = malloc((maxWidth + 2) * sizeof(char))) == NULL) {
-			perror("malloc");
-			exit(1);
+	initEntryList(&list);
+
+	for (i = 0; i < dirs->count; i++) {
+		dir = &dirs->entries[i];
+ 
+		if (dirs->count > 1 || fileCount > 0) {
+			print(dir, FTS_PATH, IS_DIR, IS_FIRST);
 		}
+		
+		watchDirectory(dir->path);
 
-		memset(name, 0, sizeof(name));
-		strcpy(name, filename);
-		replaceNonPrintableChar(name);
+		if (canStream()) {
+			initMaxWidthFiles();
+			if (streamDirectory(dir->path, printStreamed) == -1) {
+				fprintf(stderr, "%s: %s: %s\n", progname, dir->path, strerror(errno));
+				exitStatus = 1;
+			}
+			closeLinkDir();
 
-		if (maxWidth == 0) {
-			printf("%s", name);
-		} else {
-			memset(temp, 0, maxWidth + 2);
-			snprintf(temp, maxWidth + 2, "%*s ", maxWidth, name);
-			leftAllign(temp);
-			printf("%s", temp);
+			if (i + 1 < dirs->count && outputMode == OUTPUT_TEXT)
+				outNewline();
+			continue;
 		}
 
-		free(name);
-		free(temp);
+		if ((fd = openDirectory(-1, NULL, dir->path)) == -1 || readDirectory(fd, dir->path, &list) == -1) {
+			fprintf(stderr, "%s: %s: %s\n", progname, dir->path, strerror(errno));
+			exitStatus = 1;
+		}
+
+		if (topCount > 0) {
+			selectTop(&list);
+		}
+		sortEntries(&list);
+
+		phase = enterPhase(PHASE_FORMAT);
+		if (outputMode == OUTPUT_TEXT) {
+			measureEntries(&list);
+
+			if (flagl == 1 || flagn == 1 || (flags == 1 && isatty(fileno(stdout)))) {
+				printTotalSystemBlocks();
+			}
+		}
+
+		setLinkDir(dir->path, fd, -1, NULL);
+		printEntries(&list, FTS_NAME);
+		closeLinkDir();
+		resetArena();
+		enterPhase(phase);
+
+		if (fd != -1) {
+			close(fd);
+			countStat(STAT_CLOSE, 1);
+		}
+
+		if (i + 1 < dirs->count && outputMode == OUTPUT_TEXT)
+			outNewline();
+	}
+
+	freeEntryList(&list);
+}
+
+// one entry reported by --watch, as a file operand after a mark: + for
+// created, ~ for changed, - for removed (only the path is left of those)
+void 
+printChange(struct entry *e, char mark)
+{
+	if (outputMode != OUTPUT_TEXT) {
+		printRecord(e, FTS_PATH);
 		return;
 	}
 
-	if (flagw == 1) {
-		if ((name = malloc((strlen(filename) * 4 + 2) * sizeof(char))) == NULL) {
-			perror("malloc");
-			exit(1);
+	outChar(mark);
+	outChar(' ');
+	if (mark == '-') {
+		printName(e->path);
+		outNewline();
+		return;
+	}
+
+	initMaxWidthFiles();
+	updateMaxWidthFiles(e);
+	if (flagl == 1 || flagn == 1) {
+		printFlagln(e, FTS_PATH, NOT_DIR, NOT_FIRST);
+	} else {
+		printFlag1(e, FTS_PATH, NOT_DIR, NOT_FIRST);
+	}
+}
+
+// --watch lost events: list the watched directory path again, as -R
+// lists a directory, and under -R watch its subdirectories; returns -1,
+// printing nothing, if it can not be read
+int 
+relistDirectory(char *path)
+{
+	struct entry *e;
+	struct entrylist list;
+	char *child;
+	int j, fd, isFirst;
+
+	initEntryList(&list);
+	if ((fd = openDirectory(-1, NULL, path)) == -1) {
+		return -1;
+	}
+	if (readDirectory(fd, path, &list) == -1) {
+		close(fd);
+		freeEntryList(&list);
+		return -1;
+	}
+
+	if (topCount == 0) {
+		sortEntries(&list);
+	}
+
+	isFirst = NOT_FIRST;
+	setLinkDir(path, fd, -1, NULL);
+	printDirectory(path, &list, 0, &isFirst);
+
+	for (j = 0; flagR == 1 && j < list.count + list.walkOnly; j++) {
+		e = &list.entries[j];
+		if (S_ISDIR(e->sb->st_mode) && strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0) {
+			child = joinPath(path, e->name);
+			watchDirectory(child);
+			free(child);
 		}
-		if ((temp = malloc((strlen(filename) * 4 + 2) * sizeof(char))) == NULL) {
-			perror("malloc");
-			exit(1);
+	}
+
+	close(fd);
+	countStat(STAT_CLOSE, 1);
+	freeEntryList(&list);
+	return 0;
+}
+
+// the entries of one listing, in columns for -C and -x
+void 
+printEntries(struct entrylist *list, int isName)
+{
+	int i;
+
+	if (flagC == 1 && outputMode == OUTPUT_TEXT) {
+		printColumns(list, isName);
+		return;
+	}
+
+	for (i = 0; i < list->count; i++) {
+		print(&list->entries[i], isName, NOT_DIR, NOT_FIRST);
+	}
+}
+
+// width of an entry as printFlagC() prints it
+int 
+cellWidth(struct entry *e, int isName)
+{
+	struct stat sb;
+	size_t len;
+	int width;
+
+	width = 0;
+	if (flagi == 1) {
+		width += countDigits(e->sb->st_ino);
+		if (width < maxWidthFileInode) {
+			width = maxWidthFileInode;
 		}
-	
-		memset(name, 0, sizeof(name));
-		
-		while (*filename != '\0') {
-			memset(temp, 0, sizeof(temp));
-			ch = filename[0];
-			if (ch < 32 && ch > 0) {
-				snprintf(temp, sizeof(temp), "^%c", ch + 'A' - 1);
-			} else if (ch >= 127) {
-				snprintf(temp, sizeof(temp), "\\%o", ch);
-			} else {
-				snprintf(temp, sizeof(temp), "%c", ch);
-			}
-			strcat(name, temp);
-			filename++;
+		width++;
+	}
+
+	if (flags == 1) {
+		if (flagh == 1) {
+			width += 5;
+		} else {
+			len = countDigits(scaledBlocks(e->sb));
+			width += (len < maxWidthFileBlocks ? maxWidthFileBlocks : len) + 1;
 		}
+	}
+
+	len = strlen(isName == FTS_NAME ? e->name : e->path);
+	displayName(isName == FTS_NAME ? e->name : e->path, &len);
+	width += len;
 
-		if (isName == FTS_NAME) {
-			if (strlen(name) > maxWidthFileName) {
-				maxWidthFileName = strlen(name);
+	if (flagF == 1) {
+		if (S_ISLNK(e->sb->st_mode)) {
+			if (statLinkTarget(e, isName, &sb) == 0) {
+				width += fileTypeSuffix(&sb) != '\0';
 			}
+		} else {
+			width += fileTypeSuffix(e->sb) != '\0';
 		}
+	}
+
+	return width;
+}
 
-		if (isName == FTS_PATH) {
-			if (strlen(name) > maxWidthFilePath) {
-				maxWidthFilePath = strlen(name);
+// lay the entries out in as many columns as fit the line, filled top to
+// bottom (-C) or left to right (-x)
+void 
+printColumns(struct entrylist *list, int isName)
+{
+	struct layout layout;
+	int *widths;
+	int i, row, col, next;
+
+	if (list->count == 0) {
+		return;
+	}
+
+	widths = arenaAlloc(list->count * sizeof(int));
+	for (i = 0; i < list->count; i++) {
+		widths[i] = cellWidth(&list->entries[i], isName);
+	}
+
+	computeLayout(widths, list->count, lineWidth, flagx, &layout);
+
+	for (row = 0; row < layout.rows; row++) {
+		for (col = 0; col < layout.cols; col++) {
+			i = (flagx == 1) ? row * layout.cols + col : col * layout.rows + row;
+			if (i >= list->count) {
+				break;
 			}
-		}
 
-		if (maxWidth == 0) { 
-			printf("%s", name);  
-		} else {
-			memset(temp, 0, sizeof(temp));
-			if (strlen(name) < maxWidth) {
-				snprintf(temp, maxWidth + 2, "%*s ", maxWidth, name);
-				leftAllign(temp);
-				printf("%s ", temp);
-			} else {
-				maxWidth = strlen(name);
-				snprintf(temp, maxWidth + 2, "%*s ", maxWidth, name);
-				leftAllign(temp);
-				printf("%s ", temp);
+			printFlagC(&list->entries[i], isName, NOT_DIR, NOT_FIRST);
+
+			next = (flagx == 1) ? i + 1 : i + layout.rows;
+			if (col + 1 < layout.cols && next < list->count) {
+				outSpaces(layout.widths[col] - widths[i]);
 			}
+		}
+		outNewline();
+	}
+}
+
+// width of the output for -C and -x: the terminal, else $COLUMNS, else 80
+int 
+terminalWidth()
+{
+	struct winsize w;
+	char *env;
+	char *endptr;
+	long width;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0 && w.ws_col > 0) {
+		return w.ws_col;
+	}
 
+	if ((env = getenv("COLUMNS")) != NULL) {
+		width = strtol(env, &endptr, 10);
+		if (width > 0 && width <= INT_MAX && *endptr == '\0') {
+			return width;
 		}
+	}
 
-		free(name);
-		free(temp);
-		return;
+	return 80;
+}
 
+// -f with one entry per line can be printed while the directory is read;
+// -i and -s columns need the widths of the whole directory, and -s may need
+// a total first
+int 
+canStream()
+{
+	if (sortFlag != FLAG_f || topCount > 0) {
+		return 0;
 	}
 
-	printf("%s", filename);
+	return outputMode != OUTPUT_TEXT || (flag1 == 1 && flagi == 0 && flags == 0);
 }
 
-void
-printFilename(char *filename, int isName, int isDir)
+void 
+printStreamed(struct entry *e)
 {
-	int columns;
+	int phase;
 
-	if (flagC == 1) {
+	phase = enterPhase(PHASE_FORMAT);
+	print(e, FTS_NAME, NOT_DIR, NOT_FIRST);
+	resetArena();
+	enterPhase(phase);
+}
 
-		if (isDir == IS_DIR) {
-			printName(filename, 0, isName);
-			return;	
-		}
-		if (isName == FTS_NAME) {
-			columns = w.ws_col/(maxWidthFileName + 2);
-			if (++currentNameColumn <= columns) {
-				printName(filename,maxWidthFileName, isName);
-			} else {
-				currentNameColumn = 1;
-				printf("\n");
-				printName(filename,maxWidthFileName, isName);
-			}
-		} else if (isName == FTS_PATH) {
-			columns = w.ws_col/(maxWidthFilePath + 2);
-			if (++currentPathColumn <= columns) {
-				printName(filename,maxWidthFileName, isName);
-			} else {
-				currentPathColumn = 1;
-				printf("\n");
-				printName(filename,maxWidthFileName, isName);
-			}
-			
+void 
+print(struct entry *e, int isName, int isDir, int isFirst)
+{
+	// records have no directory headers
+	if (outputMode != OUTPUT_TEXT) {
+		if (isDir == NOT_DIR) {
+			printRecord(e, isName);
 		}
-
 		return;
 	}
 
-	printName(filename, 0, isName);	
+	if (flag1 == 1) {
+		printFlag1(e, isName, isDir, isFirst);
+	} else if(flagl == 1 || flagn == 1) { 
+		printFlagln(e, isName, isDir, isFirst);
+	} else if (flagC == 1) {
+		printFlagC(e, isName, isDir, isFirst);
+	} else {
+		printDefault(e, isName, isDir, isFirst);
+	}
+}
+
+// the name as it is printed under -q or -w; len is the length of name on
+// entry and of the result on return
+char *
+displayName(char *name, size_t *len)
+{
+	if (flagq == 1) {
+		return escapeName(name, len, ESCAPE_QUESTION);
+	}
+
+	if (flagw == 1) {
+		return escapeName(name, len, ESCAPE_CARET);
+	}
+
+	return name;
+}
+
+void 
+printName(char *filename)
+{
+	char *name;
+	size_t len;
 
+	len = strlen(filename);
+	name = displayName(filename, &len);
+	outBytes(name, len);
 }
 
 void 
-printFlag1(FTSENT *f, int isName, int isDir, int isFirst)
+printFlag1(struct entry *e, int isName, int isDir, int isFirst)
 {
 	if (isName == FTS_NAME) { 
-		printInode(f -> fts_statp);
-		printBlocks(f -> fts_statp);
-		printFilename(f -> fts_name, isName, isDir);
-		printFileTypeSuffix(f->fts_statp);
-		printf("\n");
+		printInode(e -> sb);
+		printBlocks(e -> sb);
+		printName(e -> name);
+		printFileTypeSuffix(e -> sb);
+		outNewline();
 	} else { 
 		if (isDir == IS_DIR) {
 			if (isFirst != IS_FIRST) {
-				printf("\n");
+				outNewline();
 			}
 
-			printFilename(f -> fts_path, isName, isDir);
-			printf(":\n");
+			printName(e -> path);
+			outChar(':');
+			outNewline();
 		} else {
-			printInode(f -> fts_statp);
-			printBlocks(f -> fts_statp);
-			printFilename(f -> fts_path, isName, isDir);
-			printFileTypeSuffix(f->fts_statp);
-			printf("\n");
+			printInode(e -> sb);
+			printBlocks(e -> sb);
+			printName(e -> path);
+			printFileTypeSuffix(e -> sb);
+			outNewline();
 		}
 	}
 }
 
 void 
-printFlagln(FTSENT *f, int isName, int isDir, int isFirst)
+printFlagln(struct entry *e, int isName, int isDir, int isFirst)
 {
 	if (isName == FTS_NAME) { 
-		printInode(f -> fts_statp);
-		printBlocks(f -> fts_statp);
-		printMode(f -> fts_statp);
-		printf("%*ld ", maxWidthFileLink, (long) f->fts_statp->st_nlink);
-		printUid(f -> fts_statp, maxWidthFileUsername);
-		printGid(f -> fts_statp, maxWidthFileGroupname);
-		printSize(f -> fts_statp, maxWidthFileSize, maxWidthFileMajor, maxWidthFileMinor);
-		printDate(f -> fts_statp);
-		printNameWithLinkedToFile(f, isName, isDir);
-		printf("\n");
+		printInode(e -> sb);
+		printBlocks(e -> sb);
+		printMode(e -> sb);
+		outNumber((long) e -> sb->st_nlink, maxWidthFileLink);
+		outChar(' ');
+		printUid(e -> sb, maxWidthFileUsername);
+		printGid(e -> sb, maxWidthFileGroupname);
+		printSize(e -> sb, maxWidthFileSize, maxWidthFileMajor, maxWidthFileMinor);
+		printDate(e -> sb);
+		printNameWithLinkedToFile(e, isName);
+		outNewline();
 	} else { 
 		if (isDir == IS_DIR) {
 			if (isFirst != IS_FIRST) {
-				printf("\n");
+				outNewline();
 			}
 
-			printFilename(f -> fts_path, isName, isDir);
-			printf(":\n");
+			printName(e -> path);
+			outChar(':');
+			outNewline();
 		} else {
-			printInode(f -> fts_statp);
-			printBlocks(f -> fts_statp);
-			printMode(f->fts_statp);
-			printf("%*ld ", maxWidthFileLink, (long) f->fts_statp->st_nlink);
-			printUid(f -> fts_statp, maxWidthFileUsername);
-			printGid(f -> fts_statp, maxWidthFileGroupname);
-			printSize(f -> fts_statp, maxWidthFileSize, maxWidthFileMajor, maxWidthFileMinor);
-			printDate(f -> fts_statp);
-			printNameWithLinkedToFile(f, isName, isDir);
-			printf("\n");
+			printInode(e -> sb);
+			printBlocks(e -> sb);
+			printMode(e -> sb);
+			outNumber((long) e -> sb->st_nlink, maxWidthFileLink);
+			outChar(' ');
+			printUid(e -> sb, maxWidthFileUsername);
+			printGid(e -> sb, maxWidthFileGroupname);
+			printSize(e -> sb, maxWidthFileSize, maxWidthFileMajor, maxWidthFileMinor);
+			printDate(e -> sb);
+			printNameWithLinkedToFile(e, isName);
+			outNewline();
 		}
 	}
 }
@@ -1046,32 +1332,33 @@ printFlagln(FTSENT *f, int isName, int isDir, int isFirst)
 // isName = 1 => fts_name, else  => fts_path
 // isDir = 1 => directory, else => file
 // isFirst = 1 => first directory, else => not first directory
-void printFlagC(FTSENT *f, int isName, int isDir, int isFirst)
+void printFlagC(struct entry *e, int isName, int isDir, int isFirst)
 {
 	if (isName == FTS_NAME) { 
-		printInode(f -> fts_statp);
-		printBlocks(f -> fts_statp);
-		printNameWithLinkedToFile(f, isName, isDir);
+		printInode(e -> sb);
+		printBlocks(e -> sb);
+		printNameWithLinkedToFile(e, isName);
 	} else { 
 		if (isDir == IS_DIR) {
 			if (isFirst != IS_FIRST) {
-				printf("\n");
+				outNewline();
 			}
 
-			printFilename(f -> fts_path, isName, isDir);
-			printf(":\n");
+			printName(e -> path);
+			outChar(':');
+			outNewline();
 		} else {
-			printInode(f -> fts_statp);
-			printBlocks(f -> fts_statp);
-			printNameWithLinkedToFile(f, isName, isDir);
+			printInode(e -> sb);
+			printBlocks(e -> sb);
+			printNameWithLinkedToFile(e, isName);
 		}
 	}
 }
 
 void 
-printDefault(FTSENT *f, int isName, int isDir, int isFirst)
+printDefault(struct entry *e, int isName, int isDir, int isFirst)
 {
-	printFlag1(f, isName, isDir, isFirst);
+	printFlag1(e, isName, isDir, isFirst);
 }
 
 
@@ -1079,7 +1366,8 @@ void
 printInode(struct stat *sb)
 {
 	if(flagi == 1) {
-		printf("%*lld ", maxWidthFileInode, (long long) sb -> st_ino);
+		outNumber((long long) sb -> st_ino, maxWidthFileInode);
+		outChar(' ');
 	}
 }
 
@@ -1087,79 +1375,50 @@ printInode(struct stat *sb)
 void 
 printMode(struct stat *sb)
 {
-	char mode[12];
+	char mode[11];
 
-	memset(mode, 0, 12);
-	strmode(sb->st_mode, mode);
-
-	if (mode[10] == ' ') {
-		mode[10] = '\0';
-	}
-	
-	printf("%s ", mode);
+	formatMode(sb->st_mode, mode);
+	mode[10] = ' ';
+	outBytes(mode, 11);
 }
 
 void
 printUid(struct stat *sb, int maxWidth)
 {
-	struct passwd *userInfo;
-	char uid[100];
+	const char *name;
 	int len;
 
-	memset(uid, 0, 100);
-	
 	if (flagn == 1) {
-		snprintf(uid, 100, "%d", sb -> st_uid);
+		outNumber(sb -> st_uid, -maxWidth);
+		outChar(' ');
 	} else if (flagl == 1) {
-		if ((userInfo = getpwuid(sb -> st_uid)) != NULL) {
-			snprintf(uid, 100, "%s", userInfo -> pw_name);
-		} else {
-			snprintf(uid, 100, "%d", sb -> st_uid);
-		}
+		name = userName(sb -> st_uid, &len);
+		outBytes(name, len);
+		outSpaces(maxWidth - len + 1);
 	}
-
-	len = strlen(uid);
-	while (len < maxWidth) {
-		uid[len] = ' ';
-		len++;
-	}
-	
-	printf("%s ", uid);
 }
 
 void
 printGid(struct stat *sb, int maxWidth)
 {
-	struct group *groupInfo;
-	char gid[100];
+	const char *name;
 	int len;
 
-	memset(gid, 0, 100);
-
 	if (flagn == 1) {
-		snprintf(gid, 100, "%d", sb -> st_gid);
+		outNumber(sb -> st_gid, -maxWidth);
+		outChar(' ');
 	} else if (flagl == 1) {
-		if ((groupInfo = getgrgid(sb -> st_gid)) != NULL) {
-			snprintf(gid, 100, "%s", groupInfo -> gr_name);
-		} else {
-			snprintf(gid, 100, "%d", sb -> st_gid);
-		}
+		name = groupName(sb -> st_gid, &len);
+		outBytes(name, len);
+		outSpaces(maxWidth - len + 1);
 	}
-
-	len = strlen(gid);
-	while (len < maxWidth) {
-		gid[len] = ' ';
-		len++;
-	}
-	
-	printf("%s ", gid);
 }
 
 void 
 printSize(struct stat *sb, int maxWidthSize, int maxWidthMajor, int maxWidthMinor)
 {
 	int maxWidth;
-	char *size;
+	char size[64];
 
 	if (flagh == 1) {
 		maxWidthSize = 4;
@@ -1171,67 +1430,63 @@ printSize(struct stat *sb, int maxWidthSize, int maxWidthMajor, int maxWidthMino
 		maxWidth = maxWidthMajor + maxWidthMinor + 2;
 	}
 
-	if ((size = malloc((maxWidth + 1 ) * sizeof(char))) == NULL) {
-		perror("malloc");
-		exit(1);
-	}
-
 	if (S_ISCHR(sb -> st_mode) || S_ISBLK(sb -> st_mode)) {
-		memset(size, 0, maxWidth + 1);
-		snprintf(size, maxWidthMajor + 2, "%*d,", maxWidthMajor, major(sb -> st_rdev));
-		printf("%s ", size);
-
-		memset(size, 0, maxWidth + 1);
-		snprintf(size, maxWidthMinor + 1, "%*d", maxWidthMinor, minor(sb -> st_rdev));
-		printf("%s ", size);
+		outNumber(major(sb -> st_rdev), maxWidthMajor);
+		outString(", ");
+		outNumber(minor(sb -> st_rdev), maxWidthMinor);
+		outChar(' ');
 
 	} else {
 		if (flagh == 1) {
+			if (maxWidth >= sizeof(size)) {
+				maxWidth = sizeof(size) - 1;
+			}
 			memset(size, 0, maxWidth + 1);
-			humanizeFilesize((long long) (sb -> st_size), size, maxWidth + 1);
+			humanizeSize((long long) (sb -> st_size), size, maxWidth + 1);
+			outString(size);
 		} else {
-			memset(size, 0, maxWidth + 1);
-			snprintf(size, maxWidth + 1, "%*lld", maxWidth, (long long) (sb -> st_size));
+			outNumber((long long) (sb -> st_size), maxWidth);
 		}
 		
-		printf("%s ", size);	
+		outChar(' ');
 	}
-
-	free(size);
 }
 
 void
 printBlocks(struct stat *sb)
 {
-	char *blocksize;
-	char *endptr;
-	long blksize;
-	long double blocksFraction;
-	long long blocks;
-
-	char *size;
+	char size[5];
 
 	if (flags == 0) {
 		return;
 	}
 
-	blocks = (long long) sb -> st_blocks;
-	blksize = 512;
-
 	if (flagh == 1) {
 		maxWidthFileBlocks = 4;
-		if ((size = malloc(5 * sizeof (char))) == NULL) {
-			perror("malloc");
-			exit(1);
-		}
-
 		memset(size, 0 , 5);
-		humanizeFilesize(blocks * 512, size, 5);
-		printf("%s ", size);
-		free(size);
+		humanizeSize((long long) sb -> st_blocks * 512, size, 5);
+		outString(size);
+		outChar(' ');
 		return;
 	}
 
+	outNumber(scaledBlocks(sb), maxWidthFileBlocks);
+	outChar(' ');
+}
+
+// st_blocks in units of BLOCKSIZE (1024 for -k), rounded up
+long long
+scaledBlocks(struct stat *sb)
+{
+	char *blocksize;
+	char *endptr;
+	long blksize;
+	long double blocksFraction;
+	long long blocks;
+
+	blocks = (long long) sb -> st_blocks;
+	blksize = 512;
+
 	if (flagk == 1) {
 		blksize = 1024;
 	} else if ((blocksize = getenv("BLOCKSIZE")) != NULL) {
@@ -1247,8 +1502,9 @@ printBlocks(struct stat *sb)
 		blocks += 1;
 	}
 
-	printf("%*lld ", maxWidthFileBlocks, blocks);
+	return blocks;
 }
+
 void 
 printTotalSystemBlocks()
 {
@@ -1256,25 +1512,21 @@ printTotalSystemBlocks()
 	char *endptr;
 	long blksize;
 	long double blocksFraction;
-	char *totalSize;
-	int i;
+	char totalSize[5];
+	char *start;
 
 	if (flagh == 1) {
-		if ((totalSize = malloc(5 * sizeof(char))) == NULL) {
-			perror("malloc");
-			exit(1);
-		}
 		memset(totalSize, 0, 5);
-		humanizeFilesize((long long) fileTotalSystemBlocks * 512, totalSize, 5);
+		humanizeSize((long long) fileTotalSystemBlocks * 512, totalSize, 5);
 		
-		while (*totalSize == ' ') {
-			for (i = 0; i < 4; i++) {
-				totalSize[i] = totalSize[i+1];
-			}
+		start = totalSize;
+		while (*start == ' ') {
+			start++;
 		}
 
-		printf("total %s\n", totalSize);
-		free(totalSize);
+		outString("total ");
+		outString(start);
+		outNewline();
 		return;
 	}
 	
@@ -1289,204 +1541,221 @@ printTotalSystemBlocks()
 		} 
 	}
 
-	printf("total %lld\n", (long long) fileTotalSystemBlocks);
+	outString("total ");
+	outNumber((long long) fileTotalSystemBlocks, 0);
+	outNewline();
+}
+
+void 
+printDate(struct stat *sb)
+{
+	time_t t;
+	const char *date;
+	int len;
+
+	switch(timeFlag) {
+		case FILE_ATIME:
+			t = sb -> st_atime;
+			break;
+		case FILE_CTIME:
+			t = sb -> st_ctime;
+			break;
+		default:
+			t = sb -> st_mtime;
+			break;
+	}
 
+	date = formatDate(t, &len);
+	outBytes(date, len);
+	outChar(' ');
 }
 
-void
-humanizeFilesize(long long filesize, char *size, int len)
+
+
+// symlinks of a listing are resolved relative to its directory: the fd
+// the listing was read with if the caller still holds it, else the
+// directory is opened once, relative to an open ancestor if there is
+// one, when the first symlink in it is printed
+char *linkDir;
+int linkDirFd = -1;
+int linkDirOwned;	// linkDirFd was opened here (or tried to be)
+int linkParentFd = -1;
+char *linkName;
+
+// symlinks of the listing at path are to be read relative to fd, or if
+// it is -1, to the directory opened as name relative to parentFd (-1:
+// name is the whole path); fd stays the caller's
+void 
+setLinkDir(char *path, int fd, int parentFd, char *name)
 {
-	int unit = 1024;
-	char units[] = {' ', 'K', 'M', 'G', 'T', 'P'};
-	int i;
-	long double fsize;
+	closeLinkDir();
+	linkDir = path;
+	linkDirFd = fd;
+	linkParentFd = parentFd;
+	linkName = name;
+}
 
-	if(filesize < unit) {
-		snprintf(size, len, "%*d", len - 1, (int)filesize);
-		return;
+// directory fd and name to pass to readlinkat()/fstatat() for a symlink
+int 
+linkAt(struct entry *e, int isName, char **name)
+{
+	if (isName == FTS_PATH) {
+		*name = e -> path;
+		return AT_FDCWD;
 	}
 
-	fsize = filesize;
+	// listings not set up with setLinkDir() are reopened by their path
+	if (linkDir != e -> path) {
+		setLinkDir(e -> path, -1, -1, e -> path);
+	}
 
-	i = 0;
-	while (fsize >= unit && i < 5) {
-		fsize /= unit;
-		i++;
+	if (linkDirFd == -1 && !linkDirOwned) {
+		linkDirFd = openDirectory(linkParentFd, linkName, linkDir);
+		linkDirOwned = 1;
 	}
 
-	memset(size, 0, len);
-	if (fsize < 10) {
-		snprintf(size, len, "%*.1Lf%c", len - 2, fsize, units[i]);
-		return;
+	if (linkDirFd == -1) {
+		// out of fds: fall back to the path
+		*name = arenaAlloc(strlen(e -> path) + strlen(e -> name) + 2);
+		strcpy(*name, e -> path);
+		strcat(*name, "/");
+		strcat(*name, e -> name);
+		return AT_FDCWD;
 	}
 
-	fsize += 0.5;
-	snprintf(size, len, "%*d%c", len - 2, (int) fsize, units[i]);
+	*name = e -> name;
+	return linkDirFd;
 }
 
+// called once a listing is printed, its path may be freed after that
 void 
-printDate(struct stat *sb)
+closeLinkDir()
 {
-	char printTime[40];
-	time_t now;
-	double diff, th;
+	if (linkDirOwned && linkDirFd != -1) {
+		close(linkDirFd);
+		countStat(STAT_CLOSE, 1);
+	}
 
-	time(&now);
-	th = 6 * 30 * 24 * 60 * 60;
-	memset(printTime, 0, 40);
-	
-	switch(timeFlag) {
-		case FILE_ATIME:
-			diff = difftime(now, sb -> st_atime);
-			if (diff < th) {
-				strftime(printTime, 40, "%b %e %R", localtime(&(sb -> st_atime)));
-			} else {
-				strftime(printTime, 40, "%b %e  %G", localtime(&(sb -> st_atime)));
-			}
-			break;
-		case FILE_MTIME:
-			diff = difftime(now, sb -> st_mtime);
-			if (diff < th) {
-				strftime(printTime, 40, "%b %e %R", localtime(&(sb -> st_mtime)));
-			} else {
-				strftime(printTime, 40, "%b %e  %G", localtime(&(sb -> st_mtime)));
-			}
-			break;
-		case FILE_CTIME:
-			diff = difftime(now, sb -> st_ctime);
-			if (diff < th) {
-				strftime(printTime, 40, "%b %e %R", localtime(&(sb -> st_ctime)));
-			} else {
-				strftime(printTime, 40, "%b %e  %G", localtime(&(sb -> st_ctime)));
-			}
-			break;
+	linkDir = NULL;
+	linkDirFd = -1;
+	linkDirOwned = 0;
+	linkParentFd = -1;
+	linkName = NULL;
+}
+
+// 1 if printing list reads symlinks, so the fd of its directory is
+// worth keeping until it is printed
+int 
+readsLinks(struct entrylist *list)
+{
+	int i;
+
+	if (flagl == 0 && flagn == 0 && flagF == 0 && outputMode != OUTPUT_JSON && outputMode != OUTPUT_BINARY) {
+		return 0;
+	}
+
+	for (i = 0; i < list->count; i++) {
+		if (S_ISLNK(list->entries[i].sb->st_mode)) {
+			return 1;
+		}
 	}
 
-	printf("%s ", printTime);
+	return 0;
 }
 
+// stat of the file a symlink points to, for the -F suffix
+// returns -1 if the link is dangling
+int 
+statLinkTarget(struct entry *e, int isName, struct stat *sb)
+{
+	char *name;
+	int fd, phase, ret;
 
+	fd = linkAt(e, isName, &name);
+	phase = enterPhase(PHASE_METADATA);
+	ret = fstatat(fd, name, sb, 0);
+	countStat(STAT_STAT, 1);
+	enterPhase(phase);
+
+	return ret;
+}
 
 void 
-printNameWithLinkedToFile(FTSENT *f, int isName, int isDir)
+printNameWithLinkedToFile(struct entry *e, int isName)
 {
-	int len;
+	int len, fd, phase;
 	char linkedToFile[PATH_MAX];
-	char resolvedPath[PATH_MAX];
-	char *path;
-	char *pwd;
+	char *name;
 	struct stat sb;
 
-	memset(linkedToFile,0,PATH_MAX);
+	if (isName == FTS_NAME) {
+		printName(e -> name);
+	} else {
+		printName(e -> path);
+	}
 
-	if(S_ISLNK(f->fts_statp->st_mode )) {
-		pwd = getenv("PWD");
-		if ((path = malloc(strlen(pwd) + (strlen(f->fts_path) + strlen(f->fts_name) + 3) * sizeof(char))) == NULL) {
-			perror("malloc");
-			exit(1);
-		}
+	if (!S_ISLNK(e -> sb->st_mode)) {
+		printFileTypeSuffix(e -> sb);
+		return;
+	}
 
-		memset(path, 0, sizeof(path));
-		
-		if (isName == FTS_PATH) {
-			if ((len = readlink(f->fts_path, linkedToFile, sizeof(linkedToFile) - 1)) == -1) {
-				perror("readlink");
-				exit(1);
-			}
-			linkedToFile[len] = '\0';
-			printf("%s -> %s", f->fts_path, linkedToFile);	
+	if (flagl == 1 || flagn == 1) {
+		fd = linkAt(e, isName, &name);
+		phase = enterPhase(PHASE_METADATA);
+		len = readlinkat(fd, name, linkedToFile, sizeof(linkedToFile) - 1);
+		countStat(STAT_READLINK, 1);
+		enterPhase(phase);
 
-			
-		} else {
-			if (*(f->fts_path) != '/') {
-				strcpy(path, pwd);
-				strcat(path, "/");
-				strcat(path, f->fts_path);
-				strcat(path, "/");
-				strcat(path, f->fts_name);
+		// the name is still listed, without its target
+		if (len == -1) {
+			if (isName == FTS_NAME) {
+				fprintf(stderr, "%s: %s/%s: %s\n", progname, e -> path, e -> name, strerror(errno));
 			} else {
-				strcpy(path, f->fts_path);
-				strcat(path, "/");
-				strcat(path, f->fts_name);
+				fprintf(stderr, "%s: %s: %s\n", progname, e -> path, strerror(errno));
 			}
-			if ((len = readlink(path, linkedToFile, sizeof(linkedToFile) - 1)) == -1) {
-				perror("readlink");
-				exit(1);
-			}	
+			exitStatus = 1;
+		} else {
 			linkedToFile[len] = '\0';
-
-			printFilename(f -> fts_name, isName, isDir);
-			if (flagl == 1 || flagn == 1) {
-				printf(" -> ");
-				printFilename(linkedToFile, LINKED_TO, isDir);
-			}
-		}
-	
-		if (flagF == 1) {
-			if (realpath(path, resolvedPath) == NULL) {
-				perror("realpath");
-				exit(1);
-			}
-
-			if(lstat(resolvedPath, &sb) == -1) {
-				perror("lstat");
-				exit(1);
-			}
-
-			printFileTypeSuffix(&sb);
+			outString(" -> ");
+			printName(linkedToFile);
 		}
+	}
 
-		free(path);
-	} else {
-		if (isName == FTS_NAME) {
-			printFilename(f -> fts_name, isName, isDir);
-		} else {
-			printFilename(f -> fts_path, isName, isDir);
-		}
-		printFileTypeSuffix(f -> fts_statp);
+	if (flagF == 1 && statLinkTarget(e, isName, &sb) == 0) {
+		printFileTypeSuffix(&sb);
 	}
 }
 
 void
 printFileTypeSuffix(struct stat *sb)
 {
-	char mode[12];
+	char suffix;
 
-	if (flagF == 0) {
-		return;
-	}
-
-	memset(mode, 0, 12);
-	strmode(sb->st_mode, mode);
-	
-	if (mode[0] == 'd') {
-		printf("/");
-		return;
-	}
-	
-	if (mode[0] == 'l') {
-		printf("@");
-		return;
-	}
-
-	if (mode[0] == 'p') {
-		printf("|");
-		return;
+	if (flagF == 1 && (suffix = fileTypeSuffix(sb)) != '\0') {
+		outChar(suffix);
 	}
+}
 
-	if (mode[0] == 's') {
-		printf("=");
-		return;
+// the -F character for a file, '\0' if there is none
+char
+fileTypeSuffix(struct stat *sb)
+{
+	switch (sb->st_mode & S_IFMT) {
+		case S_IFDIR:
+			return '/';
+		case S_IFLNK:
+			return '@';
+		case S_IFIFO:
+			return '|';
+		case S_IFSOCK:
+			return '=';
 	}
 
-	if (mode[0] == 'w') {
-		printf("%%");
-		return;
+	// executable by all, setuid/setgid/sticky bits show as s/t instead of x
+	if ((sb->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH | S_ISUID | S_ISGID | S_ISVTX)) == (S_IXUSR | S_IXGRP | S_IXOTH)) {
+		return '*';
 	}
 
-	if (mode[3] == 'x' && mode[6] == 'x' && mode[9] == 'x') {
-		printf("*");
-		return;
-	}
+	return '\0';
 }
 
@@ -0,0 +1,298 @@
+/*
+ * Shared declarations for the ls modules.
+ * Author: Sadia Akhter
+ */
+
+#ifndef LS_H
+#define LS_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define NOFLAG 0
+#define FLAG_d 1
+#define FLAG_a 2
+#define FLAG_A 3
+#define FLAG_f 4
+#define FLAG_S 5
+#define FLAG_c 6
+#define FLAG_u 7
+
+#define FILE_ATIME 100
+#define FILE_MTIME 101
+#define FILE_CTIME 102
+
+struct entry {
+	char *name;
+	char *path;
+	struct stat *sb;
+	unsigned char type;	// d_type, DT_UNKNOWN if not known
+};
+
+// entries collected for one listing; widths are computed while collecting
+// names and stats point into the pools when the list was filled by
+// readDirectory()
+struct entrylist {
+	struct entry *entries;
+	int count;
+	int size;
+
+	char *names;
+	size_t namesLen;
+	size_t namesSize;
+
+	struct stat *stats;
+	int statsSize;
+
+	int walkOnly;	// directories after count, walked but not listed
+};
+
+// a directory of the -R walk, read ahead by the parallel walker
+struct dirnode {
+	char *path;
+	char *name;	// tail of path, relative to parent if there is one
+	struct dirnode *parent;	// open ancestor, until this node is opened
+	int fd;		// held open until all children are opened and its
+			// symlinks are read, else -1
+	int unopened;	// children not opened yet, and 1 while its symlinks
+			// are not read if fd is held
+	int links;	// 1 if its symlinks are read when it is printed
+	struct dirnode *linkParent;	// open ancestor to reopen it relative to
+					// for its symlinks, if fd is not held
+	int state;
+	int refs;
+	int error;	// errno if the directory could not be read
+	struct entrylist list;
+	struct dirnode **children;	// subdirectories in print order
+	int childCount;
+};
+
+// stat fields needed by the active flags
+#define META_TYPE	0x01	// file type, d_type is enough
+#define META_MODE	0x02	// permission bits
+#define META_INO	0x04
+#define META_BLOCKS	0x08
+#define META_SIZE	0x10
+#define META_TIME	0x20	// the time selected by -c/-u
+#define META_NLINK	0x40
+#define META_ALL	0xff	// long listings
+
+// output formats
+#define OUTPUT_TEXT	0
+#define OUTPUT_ZERO	1	// --zero
+#define OUTPUT_JSON	2	// --json
+#define OUTPUT_BINARY	3	// --binary
+
+// ls.c
+extern const char *progname;
+extern const int FTS_PATH;
+extern const int FTS_NAME;
+extern int outputMode;
+extern int metaDemand;
+extern int sortFlag;
+extern int timeFlag;
+extern int flagr;
+
+int needStat(unsigned char);
+void fillTypeStat(struct stat *, unsigned char);
+char *joinPath(const char *, const char *);
+int linkAt(struct entry *, int, char **);
+int readsLinks(struct entrylist *);
+void printChange(struct entry *, char);
+int relistDirectory(char *);
+void printFileEntries(struct entrylist *);
+
+struct subtree;
+
+void printSubtree(char *, struct subtree *);
+
+void initEntryList(struct entrylist *);
+void freeEntryList(struct entrylist *);
+void addEntry(struct entrylist *, char *, char *, struct stat *);
+
+// column layout chosen by computeLayout()
+struct layout {
+	int cols;
+	int rows;
+	int *widths;
+};
+
+// parwalk.c
+int walkThreads();
+struct dirnode **startWalk(struct entrylist *, int);
+void waitNode(struct dirnode *);
+void releaseNode(struct dirnode *);
+void freeNode(struct dirnode *);
+void stopWalk();
+
+// meta.c
+struct statx;
+
+void initMeta();
+int fetchMeta(int, const char *, struct stat *);
+void statxToStat(struct statx *, struct stat *);
+unsigned int metaStatxMask();
+int metaStatxFlags();
+
+// uring.c
+int uringStatEntries(int, struct entry *, int);
+void freeRing();
+
+// dirread.c
+int readDirectory(int, char *, struct entrylist *);
+void growStats(struct entrylist *);
+void statBatch(int, struct entry *, int);
+int streamDirectory(char *, void (*)(struct entry *));
+void freeDirBuf();
+int openDirectory(int, const char *, const char *);
+int holdDirFd();
+void releaseDirFd(int);
+
+// cache.c
+void openCache();
+int cacheEnabled();
+int lookupCache(int, struct stat *, char *, struct entrylist *);
+void storeCache(struct stat *, struct entrylist *);
+void saveCache();
+
+// subtree.c
+struct subtree {
+	long long blocks;	// st_blocks, in 512 byte units
+	long long size;	// apparent size, st_size
+	long files;	// entries that are not directories
+	long dirs;	// directories, the top one included
+};
+
+extern int duMode;
+
+void startSubtree(struct subtree *, struct stat *);
+struct subtree *countEntries(struct subtree *, struct entrylist *);
+void addSubtree(struct subtree *, struct subtree *);
+
+// watch.c
+extern int watchMode;
+
+void initWatch(int);
+void watchDirectory(const char *);
+void runWatch();
+
+// filter.c
+#define FILTER_NAME	0	// --name
+#define FILTER_REGEX	1	// --regex
+#define FILTER_TYPE	2	// --type
+#define FILTER_SIZE	3	// --size
+#define FILTER_TIME	4	// --time
+
+extern int filterHidden;
+
+void initFilter(int, int);
+int addPredicate(int, const char *);
+int filterActive();
+int filterDemand();
+int filterName(const char *, unsigned char);
+int filterEntry(struct entry *);
+void filterEntries(struct entrylist *);
+
+// top.c
+extern int topCount;
+
+void selectTop(struct entrylist *);
+void offerTop(struct entrylist *);
+void printTop();
+
+// sort.c
+void sortEntries(struct entrylist *);
+int compareEntries(struct entry *, struct entry *);
+void freeSortKeys();
+
+// arena.c
+void *arenaAlloc(size_t);
+void resetArena();
+
+extern unsigned long arenaAllocs;
+extern unsigned long arenaBlocks;
+
+// fmt.c
+int countDigits(unsigned long long);
+int formatUnsigned(char *, unsigned long long);
+void formatMode(mode_t, char *);
+void humanizeSize(long long, char *, int);
+
+// escape.c
+#define ESCAPE_QUESTION	0	// -q
+#define ESCAPE_CARET	1	// -w
+
+size_t scanUnsafe(const char *, size_t, int);
+char *escapeName(char *, size_t *, int);
+
+// records.c
+void startRecords();
+void printRecord(struct entry *, int);
+
+// layout.c
+void computeLayout(const int *, int, int, int, struct layout *);
+
+// idcache.c
+const char *userName(uid_t, int *);
+const char *groupName(gid_t, int *);
+
+extern unsigned long idCacheHits;
+extern unsigned long idCacheMisses;
+
+// datecache.c
+const char *formatDate(time_t, int *);
+
+extern unsigned long dateCacheHits;
+extern unsigned long dateCacheMisses;
+
+// stats.c
+#define STAT_ENTRIES	0
+#define STAT_DIRS	1
+#define STAT_OPEN	2
+#define STAT_CLOSE	3
+#define STAT_GETDENTS	4
+#define STAT_STAT	5	// statx() or fstatat()
+#define STAT_URING_STATX	6	// statx requests through io_uring
+#define STAT_URING_ENTER	7
+#define STAT_READLINK	8
+#define STAT_WRITE	9
+#define STAT_BYTES	10	// written to stdout
+#define STAT_CACHE_HITS	11	// directories taken from LS_CACHE
+#define STAT_CACHE_MISSES	12
+#define STAT_COUNTERS	13
+
+#define PHASE_NONE	-1
+#define PHASE_TRAVERSAL	0	// opening and reading directories
+#define PHASE_METADATA	1	// stat and readlink
+#define PHASE_SORT	2
+#define PHASE_FORMAT	3
+#define PHASE_OUTPUT	4	// write()
+#define PHASE_WAIT	5	// printing thread waiting for the -R walker
+#define PHASE_COUNT	6
+
+extern int statsEnabled;
+extern unsigned long statCounters[STAT_COUNTERS];
+
+// one branch when --stats is off
+#define countStat(counter, n) do { \
+	if (statsEnabled) { \
+		__atomic_add_fetch(&statCounters[counter], (n), __ATOMIC_RELAXED); \
+	} \
+} while (0)
+
+void enableStats();
+int enterPhase(int);
+void printStats();
+
+// output.c
+void initOutput();
+void flushOutput();
+void outBytes(const char *, size_t);
+void outString(const char *);
+void outChar(char);
+void outNewline();
+void outSpaces(int);
+void outNumber(long long, int);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ * Buffered output for the listing.
+ * All formatters append to one buffer which is written out with write()
+ * or writev() once it fills up. The buffer size can be set with the
+ * LS_FLUSH_SIZE environment variable. When stdout is a terminal the buffer
+ * is also flushed at the end of every line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "ls.h"
+
+#define OUTPUT_DEFAULT_SIZE (64 * 1024)
+
+static char *outBuf;
+static size_t outLen;
+static size_t outSize;
+static int lineMode;
+
+static void 
+writeAll(struct iovec *iov, int count)
+{
+	ssize_t n;
+	int phase;
+
+	phase = enterPhase(PHASE_OUTPUT);
+	while (count > 0) {
+		countStat(STAT_WRITE, 1);
+		if ((n = writev(STDOUT_FILENO, iov, count)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("write");
+			_exit(1);
+		}
+		countStat(STAT_BYTES, n);
+
+		while (count > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	enterPhase(phase);
+}
+
+void 
+flushOutput()
+{
+	struct iovec iov;
+
+	if (outLen == 0) {
+		return;
+	}
+
+	iov.iov_base = outBuf;
+	iov.iov_len = outLen;
+	writeAll(&iov, 1);
+	outLen = 0;
+}
+
+void 
+initOutput()
+{
+	char *env;
+	char *endptr;
+	long size;
+
+	outSize = OUTPUT_DEFAULT_SIZE;
+	if ((env = getenv("LS_FLUSH_SIZE")) != NULL) {
+		size = strtol(env, &endptr, 10);
+		if (size > 0 && *endptr == '\0') {
+			outSize = size;
+		}
+	}
+
+	if ((outBuf = malloc(outSize)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	outLen = 0;
+	lineMode = isatty(STDOUT_FILENO);
+	atexit(flushOutput);
+}
+
+void 
+outBytes(const char *s, size_t len)
+{
+	struct iovec iov[2];
+
+	if (outLen + len > outSize) {
+		if (len >= outSize) {
+			// too big to buffer: write it out together with what is pending
+			iov[0].iov_base = outBuf;
+			iov[0].iov_len = outLen;
+			iov[1].iov_base = (char *) s;
+			iov[1].iov_len = len;
+			writeAll(iov, 2);
+			outLen = 0;
+			return;
+		}
+		flushOutput();
+	}
+
+	memcpy(outBuf + outLen, s, len);
+	outLen += len;
+}
+
+void 
+outString(const char *s)
+{
+	outBytes(s, strlen(s));
+}
+
+void 
+outChar(char ch)
+{
+	if (outLen == outSize) {
+		flushOutput();
+	}
+	outBuf[outLen++] = ch;
+}
+
+void 
+outNewline()
+{
+	outChar('\n');
+	if (lineMode) {
+		flushOutput();
+	}
+}
+
+void 
+outSpaces(int count)
+{
+	static const char spaces[] = "                                ";
+	int n;
+
+	while (count > 0) {
+		n = (count < (int) sizeof(spaces) - 1) ? count : (int) sizeof(spaces) - 1;
+		outBytes(spaces, n);
+		count -= n;
+	}
+}
+
+// width > 0 => right aligned, width < 0 => left aligned (like printf)
+void 
+outNumber(long long value, int width)
+{
+	char digits[24];
+	unsigned long long u;
+	int len;
+
+	u = (value < 0) ? -(unsigned long long) value : (unsigned long long) value;
+	len = sizeof(digits) - formatUnsigned(digits + sizeof(digits), u);
+
+	if (value < 0) {
+		digits[--len] = '-';
+	}
+
+	if (width > 0) {
+		outSpaces(width - ((int) sizeof(digits) - len));
+	}
+
+	outBytes(digits + len, sizeof(digits) - len);
+
+	if (width < 0) {
+		outSpaces(-width - ((int) sizeof(digits) - len));
+	}
+}
@@ -0,0 +1,443 @@
+/*
+ * Parallel directory walker for -R.
+ * A pool of worker threads reads, stats and sorts directories ahead of
+ * the printing thread. Each worker owns a deque: subdirectories it finds
+ * are pushed on its own end and popped from there (depth first, close to
+ * the print order), idle workers steal from the other end of the other
+ * deques. The printing thread walks the tree in the serial -R order and
+ * waits for (or reads itself) each directory when it gets to it, so the
+ * output is the same as the serial walk.
+ * A directory is opened relative to its parent's fd, which stays open
+ * (while the fd budget allows) until all of its subdirectories are opened
+ * and, if it has symlinks to print, until it is printed; past the budget,
+ * relative to the closest ancestor that is open, which is also what its
+ * symlinks are then read relative to.
+ * The number of threads defaults to the number of cores and can be set
+ * with the LS_THREADS environment variable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "ls.h"
+
+// directories read but not printed yet, bounds the memory used ahead
+#define WALK_LOOKAHEAD 1024
+
+#define NODE_PENDING 0
+#define NODE_BUSY 1
+#define NODE_DONE 2
+
+struct deque {
+	pthread_mutex_t lock;
+	struct dirnode **nodes;
+	int head;	// thieves take from here
+	int tail;	// the owner pushes and pops here
+	int size;
+};
+
+static struct deque *deques;
+static pthread_t *workers;
+static int workerCount;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t doneCond = PTHREAD_COND_INITIALIZER;
+static int queued;
+static int lookahead;
+static int stopping;
+
+int 
+walkThreads()
+{
+	char *env;
+	char *endptr;
+	long n;
+
+	if ((env = getenv("LS_THREADS")) != NULL) {
+		n = strtol(env, &endptr, 10);
+		if (n > 0 && *endptr == '\0') {
+			return n;
+		}
+	}
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? n : 1;
+}
+
+// a node is referenced by the tree (dropped by freeNode() once printed)
+// and by the deque it was queued on (dropped once a worker pops it); a
+// node whose fd is held is also referenced by each descendant that is
+// opened relative to it, until that one is opened
+static struct dirnode *
+newNode(char *path, char *name)
+{
+	struct dirnode *node;
+
+	if ((node = calloc(1, sizeof(struct dirnode))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	node->path = path;
+	node->name = name;
+	node->fd = -1;
+	node->refs = 2;
+	initEntryList(&node->list);
+
+	return node;
+}
+
+static void 
+unrefNode(struct dirnode *node)
+{
+	if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(node->children);
+		free(node->path);
+		free(node);
+	}
+}
+
+// one use of the held fd of node is done, it is closed after the last
+static void 
+dropFdUse(struct dirnode *node)
+{
+	if (__atomic_sub_fetch(&node->unopened, 1, __ATOMIC_ACQ_REL) == 0) {
+		releaseDirFd(node->fd);
+	}
+}
+
+// the node has been opened, the fd of the ancestor it was opened relative
+// to is not needed for it anymore
+static void 
+dropParent(struct dirnode *node)
+{
+	struct dirnode *parent;
+
+	if ((parent = node->parent) == NULL) {
+		return;
+	}
+
+	node->parent = NULL;
+	dropFdUse(parent);
+	unrefNode(parent);
+}
+
+static void 
+pushNode(struct deque *dq, struct dirnode *node)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail == dq->size) {
+		if (dq->head > 0) {
+			memmove(dq->nodes, dq->nodes + dq->head, (dq->tail - dq->head) * sizeof(struct dirnode *));
+			dq->tail -= dq->head;
+			dq->head = 0;
+		} else {
+			dq->size = (dq->size == 0) ? 64 : dq->size * 2;
+			if ((dq->nodes = realloc(dq->nodes, dq->size * sizeof(struct dirnode *))) == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+	}
+	dq->nodes[dq->tail++] = node;
+	pthread_mutex_unlock(&dq->lock);
+
+	pthread_mutex_lock(&poolLock);
+	queued++;
+	pthread_cond_signal(&workCond);
+	pthread_mutex_unlock(&poolLock);
+}
+
+// fromTail = 1 => owner end, fromTail = 0 => steal from the head
+static struct dirnode *
+popNode(struct deque *dq, int fromTail)
+{
+	struct dirnode *node;
+
+	node = NULL;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->head < dq->tail) {
+		node = fromTail ? dq->nodes[--dq->tail] : dq->nodes[dq->head++];
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	if (node != NULL) {
+		pthread_mutex_lock(&poolLock);
+		queued--;
+		pthread_mutex_unlock(&poolLock);
+	}
+
+	return node;
+}
+
+// returns 1 if the caller now owns the node
+static int 
+claimNode(struct dirnode *node)
+{
+	int expected;
+
+	expected = NODE_PENDING;
+	return __atomic_compare_exchange_n(&node->state, &expected, NODE_BUSY, 0, 
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// read, stat and sort a directory and queue its subdirectories on dq
+static void 
+readNode(struct dirnode *node, struct deque *dq)
+{
+	struct entry *e;
+	struct dirnode *anchor, *child;
+	char *path;
+	int i, n, fd;
+
+	fd = openDirectory(node->parent != NULL ? node->parent->fd : -1, node->name, node->path);
+
+	if (fd == -1 || readDirectory(fd, node->path, &node->list) == -1) {
+		node->error = errno;
+	}
+
+	// --top picks its entries from the whole walk, in any order
+	if (topCount == 0) {
+		sortEntries(&node->list);
+	}
+
+	// directories the predicates dropped are walked after the others
+	n = 0;
+	for (i = 0; i < node->list.count + node->list.walkOnly; i++) {
+		e = &node->list.entries[i];
+		if (S_ISDIR(e->sb->st_mode) && strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0) {
+			n++;
+		}
+	}
+
+	if (n > 0 && (node->children = malloc(n * sizeof(struct dirnode *))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < node->list.count + node->list.walkOnly; i++) {
+		e = &node->list.entries[i];
+		if (S_ISDIR(e->sb->st_mode) && strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0) {
+			path = joinPath(node->path, e->name);
+			node->children[node->childCount++] = newNode(path, path + strlen(path) - strlen(e->name));
+		}
+	}
+
+	// the fd is also kept for the symlinks, which are read as the node is
+	// printed, so their paths are never walked again
+	node->links = fd != -1 && readsLinks(&node->list);
+
+	// set up before the children are queued, a worker may take one at once
+	if (fd != -1 && (node->childCount > 0 || node->links) && holdDirFd()) {
+		node->fd = fd;
+		node->unopened = node->childCount + node->links;
+		__atomic_add_fetch(&node->refs, node->childCount, __ATOMIC_RELAXED);
+		for (i = 0; i < node->childCount; i++) {
+			node->children[i]->parent = node;
+		}
+	} else {
+		if (fd != -1) {
+			close(fd);
+			countStat(STAT_CLOSE, 1);
+		}
+
+		// this node still holds a reference on anchor, which keeps its
+		// fd open until the children are added
+		if ((anchor = node->parent) != NULL && node->childCount > 0) {
+			__atomic_add_fetch(&anchor->unopened, node->childCount, __ATOMIC_ACQ_REL);
+			__atomic_add_fetch(&anchor->refs, node->childCount, __ATOMIC_RELAXED);
+		}
+
+		// and so is the node itself when its symlinks are read
+		if (anchor != NULL && node->links) {
+			__atomic_add_fetch(&anchor->unopened, 1, __ATOMIC_ACQ_REL);
+			__atomic_add_fetch(&anchor->refs, 1, __ATOMIC_RELAXED);
+			node->linkParent = anchor;
+		}
+
+		// names stay relative to the anchor, or whole paths without one
+		for (i = 0; i < node->childCount; i++) {
+			child = node->children[i];
+			child->parent = anchor;
+			child->name = child->path + (node->name - node->path);
+		}
+	}
+	dropParent(node);
+
+	// pushed last to first, so the owner pops them in print order
+	for (i = node->childCount - 1; i >= 0; i--) {
+		pushNode(dq, node->children[i]);
+	}
+
+	pthread_mutex_lock(&poolLock);
+	lookahead++;
+	__atomic_store_n(&node->state, NODE_DONE, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&doneCond);
+	pthread_mutex_unlock(&poolLock);
+}
+
+static struct dirnode *
+findWork(int self)
+{
+	struct dirnode *node;
+	int i;
+
+	if ((node = popNode(&deques[self], 1)) != NULL) {
+		return node;
+	}
+
+	for (i = 1; i < workerCount; i++) {
+		if ((node = popNode(&deques[(self + i) % workerCount], 0)) != NULL) {
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+static void *
+workerMain(void *arg)
+{
+	struct dirnode *node;
+	int self;
+
+	self = (int) (long) arg;
+
+	for (;;) {
+		pthread_mutex_lock(&poolLock);
+		while (!stopping && (queued == 0 || lookahead >= WALK_LOOKAHEAD)) {
+			pthread_cond_wait(&workCond, &poolLock);
+		}
+		if (stopping) {
+			pthread_mutex_unlock(&poolLock);
+			break;
+		}
+		pthread_mutex_unlock(&poolLock);
+
+		if ((node = findWork(self)) != NULL) {
+			if (claimNode(node)) {
+				readNode(node, &deques[self]);
+			}
+			unrefNode(node);
+		}
+	}
+
+	freeDirBuf();
+	freeRing();
+	freeSortKeys();
+	return NULL;
+}
+
+// start reading the trees under dirs; returns one node per directory
+struct dirnode **
+startWalk(struct entrylist *dirs, int threads)
+{
+	struct dirnode **roots;
+	char *path;
+	int i;
+
+	workerCount = threads;
+
+	if ((roots = malloc(dirs->count * sizeof(struct dirnode *))) == NULL ||
+	    (deques = calloc(workerCount, sizeof(struct deque))) == NULL ||
+	    (workers = malloc(workerCount * sizeof(pthread_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < workerCount; i++) {
+		pthread_mutex_init(&deques[i].lock, NULL);
+	}
+
+	for (i = dirs->count - 1; i >= 0; i--) {
+		if ((path = strdup(dirs->entries[i].path)) == NULL) {
+			perror("strdup");
+			exit(1);
+		}
+		roots[i] = newNode(path, path);
+		pushNode(&deques[0], roots[i]);
+	}
+
+	for (i = 0; i < workerCount; i++) {
+		if ((errno = pthread_create(&workers[i], NULL, workerMain, (void *) (long) i)) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	return roots;
+}
+
+// wait until the node is read; reads it here if no worker has started it
+void 
+waitNode(struct dirnode *node)
+{
+	if (claimNode(node)) {
+		readNode(node, &deques[0]);
+		return;
+	}
+
+	pthread_mutex_lock(&poolLock);
+	while (__atomic_load_n(&node->state, __ATOMIC_ACQUIRE) != NODE_DONE) {
+		pthread_cond_wait(&doneCond, &poolLock);
+	}
+	pthread_mutex_unlock(&poolLock);
+}
+
+// the entries of the node have been printed, its memory can be reused
+void 
+releaseNode(struct dirnode *node)
+{
+	freeEntryList(&node->list);
+
+	// its symlinks have been read
+	if (node->linkParent != NULL) {
+		dropFdUse(node->linkParent);
+		unrefNode(node->linkParent);
+		node->linkParent = NULL;
+	} else if (node->links && node->fd != -1) {
+		dropFdUse(node);
+	}
+
+	pthread_mutex_lock(&poolLock);
+	lookahead--;
+	pthread_cond_broadcast(&workCond);
+	pthread_mutex_unlock(&poolLock);
+}
+
+// the node and its subtree have been printed
+void 
+freeNode(struct dirnode *node)
+{
+	unrefNode(node);
+}
+
+void 
+stopWalk()
+{
+	int i;
+
+	pthread_mutex_lock(&poolLock);
+	stopping = 1;
+	pthread_cond_broadcast(&workCond);
+	pthread_mutex_unlock(&poolLock);
+
+	for (i = 0; i < workerCount; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	// nodes the printing thread read itself may still be queued
+	for (i = 0; i < workerCount; i++) {
+		while (deques[i].head < deques[i].tail) {
+			unrefNode(deques[i].nodes[deques[i].head++]);
+		}
+		pthread_mutex_destroy(&deques[i].lock);
+		free(deques[i].nodes);
+	}
+	free(deques);
+	free(workers);
+}
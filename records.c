@@ -0,0 +1,402 @@
+/*
+ * Machine-readable output: one record per entry, written straight to the
+ * output buffer with no widths, padding, headers or totals.
+ *   --zero    the path of the entry followed by a NUL byte
+ *   --json    a JSON object per line with the path, name, type, the raw
+ *             stat fields and the target of a symlink; bytes of a name
+ *             that are not valid UTF-8 are written as \udc80..\udcff, the
+ *             "surrogateescape" convention, so the name can be restored
+ *   --binary  a stream header followed by fixed-layout records in native
+ *             byte order, see struct binaryhead and struct binaryrecord
+ * The path of an entry is its directory's path and its name, or the
+ * operand as given for file operands.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "ls.h"
+
+#define BINARY_MAGIC "LSBIN001"
+
+struct binaryhead {
+	char magic[8];
+	uint32_t recordSize;	// sizeof(struct binaryrecord)
+	uint32_t byteOrder;	// 0x01020304 as written by this host
+};
+
+// followed by pathLen bytes of path and targetLen bytes of symlink target,
+// zero padded to the next multiple of 8; size covers all of it
+struct binaryrecord {
+	uint32_t size;
+	uint32_t pathLen;
+	uint32_t targetLen;
+	uint32_t mode;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t nlink;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t rdev;
+	int64_t fileSize;
+	int64_t blocks;
+	int64_t blksize;
+	int64_t atimeSec;
+	int64_t atimeNsec;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+	int64_t ctimeSec;
+	int64_t ctimeNsec;
+};
+
+static const char hexDigits[] = "0123456789abcdef";
+
+// the binary stream header, written once before any record
+void 
+startRecords()
+{
+	struct binaryhead head;
+
+	if (outputMode != OUTPUT_BINARY) {
+		return;
+	}
+
+	memcpy(head.magic, BINARY_MAGIC, 8);
+	head.recordSize = sizeof(struct binaryrecord);
+	head.byteOrder = 0x01020304;
+	outBytes((const char *) &head, sizeof(head));
+}
+
+// path of the entry, taken from the arena for names in a directory
+static char *
+recordPath(struct entry *e, int isName, size_t *len)
+{
+	size_t dirLen, nameLen;
+	char *path;
+
+	if (isName != FTS_NAME) {
+		*len = strlen(e->path);
+		return e->path;
+	}
+
+	dirLen = strlen(e->path);
+	if (dirLen > 0 && e->path[dirLen - 1] == '/') {
+		dirLen--;
+	}
+	nameLen = strlen(e->name);
+
+	path = arenaAlloc(dirLen + nameLen + 2);
+	memcpy(path, e->path, dirLen);
+	path[dirLen] = '/';
+	memcpy(path + dirLen + 1, e->name, nameLen + 1);
+	*len = dirLen + 1 + nameLen;
+
+	return path;
+}
+
+// target of a symlink, NULL if e is not one or it can not be read
+static char *
+recordTarget(struct entry *e, int isName, size_t *len)
+{
+	char buf[PATH_MAX];
+	char *name, *target;
+	ssize_t n;
+	int fd;
+
+	if (!S_ISLNK(e->sb->st_mode)) {
+		return NULL;
+	}
+
+	fd = linkAt(e, isName, &name);
+	if ((n = readlinkat(fd, name, buf, sizeof(buf))) == -1) {
+		return NULL;
+	}
+	countStat(STAT_READLINK, 1);
+
+	target = arenaAlloc(n + 1);
+	memcpy(target, buf, n);
+	target[n] = '\0';
+	*len = n;
+
+	return target;
+}
+
+// length of the valid UTF-8 sequence at s, 0 if there is none
+static size_t 
+utf8Length(const unsigned char *s, size_t len)
+{
+	size_t need, i;
+	unsigned int cp;
+
+	if (s[0] < 0xc2 || s[0] > 0xf4) {
+		return 0;
+	}
+
+	need = (s[0] < 0xe0) ? 2 : (s[0] < 0xf0) ? 3 : 4;
+	if (len < need) {
+		return 0;
+	}
+
+	cp = s[0] & (0x7f >> need);
+	for (i = 1; i < need; i++) {
+		if ((s[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+		cp = (cp << 6) | (s[i] & 0x3f);
+	}
+
+	// overlong forms, surrogates and code points past U+10FFFF
+	if ((need == 3 && cp < 0x800) || (need == 4 && cp < 0x10000) ||
+	    (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+		return 0;
+	}
+
+	return need;
+}
+
+static void 
+outEscape(const char *prefix, unsigned int value)
+{
+	char buf[8];
+	int len;
+
+	len = strlen(prefix);
+	memcpy(buf, prefix, len);
+	buf[len++] = hexDigits[(value >> 4) & 0xf];
+	buf[len++] = hexDigits[value & 0xf];
+	outBytes(buf, len);
+}
+
+// s as a JSON string, with the quotes; runs of printable ASCII are found
+// with the -q scanner and copied as they are
+static void 
+outJsonString(const char *s, size_t len)
+{
+	const unsigned char *p;
+	const char *quote, *backslash;
+	size_t i, start, n;
+
+	p = (const unsigned char *) s;
+	outChar('"');
+	start = 0;
+	i = 0;
+	while (i < len) {
+		n = i + scanUnsafe(s + i, len - i, ESCAPE_QUESTION);
+		if ((quote = memchr(s + i, '"', n - i)) != NULL) {
+			n = quote - s;
+		}
+		if ((backslash = memchr(s + i, '\\', n - i)) != NULL) {
+			n = backslash - s;
+		}
+		if ((i = n) == len) {
+			break;
+		}
+
+		if (p[i] >= 0x80 && (n = utf8Length(p + i, len - i)) > 0) {
+			i += n;
+			continue;
+		}
+
+		outBytes(s + start, i - start);
+		if (p[i] == '"' || p[i] == '\\') {
+			outChar('\\');
+			outChar(p[i]);
+		} else if (p[i] == '\n') {
+			outBytes("\\n", 2);
+		} else if (p[i] == '\t') {
+			outBytes("\\t", 2);
+		} else if (p[i] < 0x80) {
+			outEscape("\\u00", p[i]);
+		} else {
+			outEscape("\\udc", p[i]);
+		}
+		start = ++i;
+	}
+	outBytes(s + start, i - start);
+	outChar('"');
+}
+
+// a key and the length of its text, for putKey()
+#define KEY(s) s, sizeof(s) - 1
+
+static char *
+putKey(char *p, const char *key, size_t len)
+{
+	memcpy(p, key, len);
+	return p + len;
+}
+
+static char *
+putUnsigned(char *p, unsigned long long value)
+{
+	int len;
+
+	len = countDigits(value);
+	formatUnsigned(p + len, value);
+	return p + len;
+}
+
+static char *
+putSigned(char *p, long long value)
+{
+	if (value < 0) {
+		*p++ = '-';
+		return putUnsigned(p, -(unsigned long long) value);
+	}
+
+	return putUnsigned(p, value);
+}
+
+static const char *
+typeName(mode_t mode)
+{
+	switch (mode & S_IFMT) {
+		case S_IFREG:
+			return "file";
+		case S_IFDIR:
+			return "dir";
+		case S_IFLNK:
+			return "symlink";
+		case S_IFCHR:
+			return "char";
+		case S_IFBLK:
+			return "block";
+		case S_IFIFO:
+			return "fifo";
+		case S_IFSOCK:
+			return "socket";
+		default:
+			return "unknown";
+	}
+}
+
+static void 
+printJsonRecord(struct entry *e, int isName, char *path, size_t pathLen)
+{
+	struct stat *sb;
+	char buf[512];
+	char *target, *name, *p;
+	size_t targetLen;
+
+	sb = e->sb;
+	name = (isName == FTS_NAME) ? e->name : e->path;
+
+	outBytes("{\"path\":", 8);
+	outJsonString(path, pathLen);
+	outBytes(",\"name\":", 8);
+	outJsonString(name, strlen(name));
+	outBytes(",\"type\":\"", 9);
+	outString(typeName(sb->st_mode));
+	outChar('"');
+
+	// the numbers take at most 16 * (keys + 20 digits) bytes
+	p = buf;
+	p = putKey(p, KEY(",\"dev\":"));
+	p = putUnsigned(p, sb->st_dev);
+	p = putKey(p, KEY(",\"ino\":"));
+	p = putUnsigned(p, sb->st_ino);
+	p = putKey(p, KEY(",\"mode\":"));
+	p = putUnsigned(p, sb->st_mode);
+	p = putKey(p, KEY(",\"nlink\":"));
+	p = putUnsigned(p, sb->st_nlink);
+	p = putKey(p, KEY(",\"uid\":"));
+	p = putUnsigned(p, sb->st_uid);
+	p = putKey(p, KEY(",\"gid\":"));
+	p = putUnsigned(p, sb->st_gid);
+	p = putKey(p, KEY(",\"rdev\":"));
+	p = putUnsigned(p, sb->st_rdev);
+	p = putKey(p, KEY(",\"size\":"));
+	p = putSigned(p, sb->st_size);
+	p = putKey(p, KEY(",\"blocks\":"));
+	p = putSigned(p, sb->st_blocks);
+	p = putKey(p, KEY(",\"blksize\":"));
+	p = putSigned(p, sb->st_blksize);
+	p = putKey(p, KEY(",\"atime\":"));
+	p = putSigned(p, sb->st_atim.tv_sec);
+	p = putKey(p, KEY(",\"atime_nsec\":"));
+	p = putSigned(p, sb->st_atim.tv_nsec);
+	p = putKey(p, KEY(",\"mtime\":"));
+	p = putSigned(p, sb->st_mtim.tv_sec);
+	p = putKey(p, KEY(",\"mtime_nsec\":"));
+	p = putSigned(p, sb->st_mtim.tv_nsec);
+	p = putKey(p, KEY(",\"ctime\":"));
+	p = putSigned(p, sb->st_ctim.tv_sec);
+	p = putKey(p, KEY(",\"ctime_nsec\":"));
+	p = putSigned(p, sb->st_ctim.tv_nsec);
+	outBytes(buf, p - buf);
+
+	if ((target = recordTarget(e, isName, &targetLen)) != NULL) {
+		outBytes(",\"target\":", 10);
+		outJsonString(target, targetLen);
+	}
+
+	outBytes("}\n", 2);
+}
+
+static void 
+printBinaryRecord(struct entry *e, int isName, char *path, size_t pathLen)
+{
+	static const char pad[8];
+	struct binaryrecord r;
+	struct stat *sb;
+	char *target;
+	size_t targetLen, len;
+
+	sb = e->sb;
+	targetLen = 0;
+	target = recordTarget(e, isName, &targetLen);
+	len = sizeof(r) + pathLen + targetLen;
+
+	memset(&r, 0, sizeof(r));
+	r.size = (len + 7) & ~(size_t) 7;
+	r.pathLen = pathLen;
+	r.targetLen = targetLen;
+	r.mode = sb->st_mode;
+	r.dev = sb->st_dev;
+	r.ino = sb->st_ino;
+	r.nlink = sb->st_nlink;
+	r.uid = sb->st_uid;
+	r.gid = sb->st_gid;
+	r.rdev = sb->st_rdev;
+	r.fileSize = sb->st_size;
+	r.blocks = sb->st_blocks;
+	r.blksize = sb->st_blksize;
+	r.atimeSec = sb->st_atim.tv_sec;
+	r.atimeNsec = sb->st_atim.tv_nsec;
+	r.mtimeSec = sb->st_mtim.tv_sec;
+	r.mtimeNsec = sb->st_mtim.tv_nsec;
+	r.ctimeSec = sb->st_ctim.tv_sec;
+	r.ctimeNsec = sb->st_ctim.tv_nsec;
+
+	outBytes((const char *) &r, sizeof(r));
+	outBytes(path, pathLen);
+	if (target != NULL) {
+		outBytes(target, targetLen);
+	}
+	outBytes(pad, r.size - len);
+}
+
+void 
+printRecord(struct entry *e, int isName)
+{
+	char *path;
+	size_t pathLen;
+
+	path = recordPath(e, isName, &pathLen);
+	switch (outputMode) {
+		case OUTPUT_ZERO:
+			outBytes(path, pathLen + 1);
+			break;
+		case OUTPUT_JSON:
+			printJsonRecord(e, isName, path, pathLen);
+			break;
+		case OUTPUT_BINARY:
+			printBinaryRecord(e, isName, path, pathLen);
+			break;
+	}
+}
@@ -0,0 +1,330 @@
+/*
+ * Sort engine.
+ * A compact key is extracted once per entry: the size for -S, the
+ * timestamp in nanoseconds for -t, or the first bytes of the case folded
+ * name otherwise. Numeric keys are mapped so that ascending order is the
+ * listing order and sorted with a radix sort; entries with equal keys are
+ * then ordered by name. Names compare their key prefix first and only look
+ * at the strings when the prefixes are equal. -r reverses the whole order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "ls.h"
+
+// below this a comparison sort beats the radix passes
+#define RADIX_MIN 64
+
+struct sortkey {
+	unsigned long long key;
+	struct entry *e;
+};
+
+// scratch memory per thread, the -R walker sorts in its worker threads
+static __thread struct sortkey *keys;
+static __thread struct sortkey *keysTmp;
+static __thread struct entry *entriesTmp;
+static __thread int keysSize;
+
+// first 8 bytes of the name folded to lower case, big endian, so that
+// comparing keys compares the prefixes like strcasecmp does
+static unsigned long long 
+namePrefix(const char *name)
+{
+	unsigned long long key;
+	unsigned char c;
+	int i;
+
+	key = 0;
+	for (i = 0; i < 8; i++) {
+		c = (unsigned char) *name;
+		if (c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		}
+		key = (key << 8) | c;
+		if (*name != '\0') {
+			name++;
+		}
+	}
+
+	return key;
+}
+
+// the seconds that fit in a 64 bit count of nanoseconds, roughly the
+// years 1678 to 2262
+#define TIME_KEY_MAX_SEC (LLONG_MAX / 1000000000LL - 1)
+#define TIME_KEY_MIN_SEC (LLONG_MIN / 1000000000LL + 1)
+
+static unsigned long long 
+timeKey(struct timespec *ts)
+{
+	long long ns;
+
+	// times out of range saturate and are told apart by cmpTimes()
+	if (ts->tv_sec > TIME_KEY_MAX_SEC) {
+		ns = LLONG_MAX;
+	} else if (ts->tv_sec < TIME_KEY_MIN_SEC) {
+		ns = LLONG_MIN;
+	} else {
+		ns = (long long) ts->tv_sec * 1000000000LL + ts->tv_nsec;
+	}
+
+	// newest first: flip the sign bit to order as unsigned, then invert
+	return ~((unsigned long long) ns ^ (1ULL << 63));
+}
+
+// the time -t sorts on, NULL if it does not
+static struct timespec *
+sortTime(struct entry *e)
+{
+	switch (sortFlag) {
+		case FILE_ATIME:
+			return &e->sb->st_atim;
+		case FILE_MTIME:
+			return &e->sb->st_mtim;
+		case FILE_CTIME:
+			return &e->sb->st_ctim;
+	}
+
+	return NULL;
+}
+
+// newest first, seconds then nanoseconds
+static int 
+cmpTimes(struct timespec *a, struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec) {
+		return (a->tv_sec > b->tv_sec) ? -1 : 1;
+	}
+	if (a->tv_nsec != b->tv_nsec) {
+		return (a->tv_nsec > b->tv_nsec) ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static unsigned long long 
+entryKey(struct entry *e)
+{
+	switch (sortFlag) {
+		case FLAG_S:
+			// largest first
+			return ~(unsigned long long) e->sb->st_size;
+		case FILE_ATIME:
+		case FILE_MTIME:
+		case FILE_CTIME:
+			return timeKey(sortTime(e));
+	}
+
+	return namePrefix(e->name);
+}
+
+static int 
+cmpNames(const char *s1, const char *s2)
+{
+	int ret;
+
+	if ((ret = strcasecmp(s1, s2)) != 0) {
+		return ret;
+	}
+
+	return strcmp(s1, s2);
+}
+
+// names of keys with equal numeric keys, or equal name prefixes
+static int 
+cmpKeyNames(const struct sortkey *a, const struct sortkey *b)
+{
+	struct timespec *ta, *tb;
+	unsigned long long pa, pb;
+	int ret;
+
+	// saturated time keys are equal without the times being so
+	if ((ta = sortTime(a->e)) != NULL) {
+		tb = sortTime(b->e);
+		if ((ret = cmpTimes(ta, tb)) != 0) {
+			return ret;
+		}
+	}
+
+	if (sortFlag != NOFLAG) {
+		pa = namePrefix(a->e->name);
+		pb = namePrefix(b->e->name);
+		if (pa != pb) {
+			return (pa < pb) ? -1 : 1;
+		}
+	}
+
+	return cmpNames(a->e->name, b->e->name);
+}
+
+static int 
+cmpKeys(const void *p1, const void *p2)
+{
+	const struct sortkey *a = p1;
+	const struct sortkey *b = p2;
+
+	if (a->key != b->key) {
+		return (a->key < b->key) ? -1 : 1;
+	}
+
+	return cmpKeyNames(a, b);
+}
+
+static int 
+cmpKeyNamesQsort(const void *p1, const void *p2)
+{
+	return cmpKeyNames(p1, p2);
+}
+
+// LSD radix sort on the 64 bit keys, bytes that are the same for all keys
+// are skipped; the sorted keys end up in keys
+static void 
+radixSort(int n)
+{
+	static __thread size_t counts[8][256];
+	struct sortkey *src, *dst, *swap;
+	size_t offset, c;
+	int i, b, shift;
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < n; i++) {
+		for (b = 0; b < 8; b++) {
+			counts[b][(keys[i].key >> (b * 8)) & 0xff]++;
+		}
+	}
+
+	src = keys;
+	dst = keysTmp;
+	for (b = 0; b < 8; b++) {
+		shift = b * 8;
+		if (counts[b][(keys[0].key >> shift) & 0xff] == (size_t) n) {
+			continue;
+		}
+
+		offset = 0;
+		for (i = 0; i < 256; i++) {
+			c = counts[b][i];
+			counts[b][i] = offset;
+			offset += c;
+		}
+
+		for (i = 0; i < n; i++) {
+			dst[counts[b][(src[i].key >> shift) & 0xff]++] = src[i];
+		}
+
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+
+	if (src != keys) {
+		memcpy(keys, src, n * sizeof(struct sortkey));
+	}
+}
+
+static void 
+growKeys(int n)
+{
+	if (n <= keysSize) {
+		return;
+	}
+
+	keysSize = n;
+	free(keys);
+	free(keysTmp);
+	free(entriesTmp);
+	if ((keys = malloc(n * sizeof(struct sortkey))) == NULL ||
+	    (keysTmp = malloc(n * sizeof(struct sortkey))) == NULL ||
+	    (entriesTmp = malloc(n * sizeof(struct entry))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+}
+
+// < 0 if a is listed before b, 0 if either may come first (-f)
+int 
+compareEntries(struct entry *a, struct entry *b)
+{
+	struct sortkey ka, kb;
+	int ret;
+
+	if (sortFlag == FLAG_f) {
+		return 0;
+	}
+
+	ka.key = entryKey(a);
+	ka.e = a;
+	kb.key = entryKey(b);
+	kb.e = b;
+	ret = cmpKeys(&ka, &kb);
+
+	return (flagr == 1) ? -ret : ret;
+}
+
+static void 
+sortRange(struct entry *entries, int n)
+{
+	int i, j, phase;
+
+	if (n < 2) {
+		return;
+	}
+
+	phase = enterPhase(PHASE_SORT);
+	growKeys(n);
+	for (i = 0; i < n; i++) {
+		keys[i].key = entryKey(&entries[i]);
+		keys[i].e = &entries[i];
+	}
+
+	if (n < RADIX_MIN) {
+		qsort(keys, n, sizeof(struct sortkey), cmpKeys);
+	} else {
+		radixSort(n);
+
+		// order runs of equal keys by name
+		for (i = 0; i < n; i = j) {
+			for (j = i + 1; j < n && keys[j].key == keys[i].key; j++)
+				;
+			if (j - i > 1) {
+				qsort(keys + i, j - i, sizeof(struct sortkey), cmpKeyNamesQsort);
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		entriesTmp[flagr == 1 ? n - 1 - i : i] = *keys[i].e;
+	}
+	memcpy(entries, entriesTmp, n * sizeof(struct entry));
+	enterPhase(phase);
+}
+
+// sort the entries in listing order (no-op under -f); directories only
+// walked are sorted among themselves
+void 
+sortEntries(struct entrylist *list)
+{
+	if (sortFlag == FLAG_f) {
+		return;
+	}
+
+	sortRange(list->entries, list->count);
+	sortRange(list->entries + list->count, list->walkOnly);
+}
+
+// called by threads that sorted entries before they exit
+void 
+freeSortKeys()
+{
+	free(keys);
+	free(keysTmp);
+	free(entriesTmp);
+	keys = NULL;
+	keysTmp = NULL;
+	entriesTmp = NULL;
+	keysSize = 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Instrumentation for --stats.
+ * Counters are bumped with countStat() and time is charged to phases with
+ * enterPhase(): each thread is in at most one phase at a time, and
+ * entering a phase charges the time since the last switch to the phase it
+ * leaves, so phases nest (a write while formatting counts as output only).
+ * When --stats is off both cost one branch on statsEnabled. The summary
+ * goes to stderr once the listing is written.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "ls.h"
+
+int statsEnabled;
+unsigned long statCounters[STAT_COUNTERS];
+
+static unsigned long long phaseNs[PHASE_COUNT];
+static unsigned long long startNs;
+
+static __thread int currentPhase = PHASE_NONE;
+static __thread unsigned long long phaseSince;
+
+static const char *counterNames[STAT_COUNTERS] = {
+	"entries",
+	"directories",
+	"open",
+	"close",
+	"getdents64",
+	"stat",
+	"io_uring statx",
+	"io_uring_enter",
+	"readlink",
+	"write",
+	"bytes written",
+	"dir cache hits",
+	"dir cache misses",
+};
+
+static const char *phaseNames[PHASE_COUNT] = {
+	"traversal",
+	"metadata",
+	"sort",
+	"format",
+	"output",
+	"walker wait",
+};
+
+static unsigned long long 
+monotonicNs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void 
+enableStats()
+{
+	statsEnabled = 1;
+	startNs = monotonicNs();
+}
+
+// switch the calling thread to phase (PHASE_NONE: stop the clock) and
+// return the phase it was in, to be entered again when this one is over
+int 
+enterPhase(int phase)
+{
+	unsigned long long now;
+	int previous;
+
+	if (statsEnabled == 0) {
+		return PHASE_NONE;
+	}
+
+	now = monotonicNs();
+	previous = currentPhase;
+	if (previous != PHASE_NONE) {
+		__atomic_add_fetch(&phaseNs[previous], now - phaseSince, __ATOMIC_RELAXED);
+	}
+
+	currentPhase = phase;
+	phaseSince = now;
+
+	return previous;
+}
+
+void 
+printStats()
+{
+	int i;
+
+	fprintf(stderr, "%s: stats\n", progname);
+	for (i = 0; i < STAT_COUNTERS; i++) {
+		fprintf(stderr, "  %-22s %14lu\n", counterNames[i], statCounters[i]);
+	}
+	fprintf(stderr, "  %-22s %14lu\n", "id cache hits", idCacheHits);
+	fprintf(stderr, "  %-22s %14lu\n", "id cache misses", idCacheMisses);
+	fprintf(stderr, "  %-22s %14lu\n", "date cache hits", dateCacheHits);
+	fprintf(stderr, "  %-22s %14lu\n", "date cache misses", dateCacheMisses);
+#ifdef LS_DEBUG
+	fprintf(stderr, "  %-22s %14lu\n", "arena allocations", arenaAllocs);
+#endif
+	fprintf(stderr, "  %-22s %14lu\n", "arena blocks", arenaBlocks);
+
+	// worker threads add up, so phases can sum to more than the total
+	fprintf(stderr, "  time (ms, summed over threads)\n");
+	for (i = 0; i < PHASE_COUNT; i++) {
+		fprintf(stderr, "  %-22s %14.3f\n", phaseNames[i], phaseNs[i] / 1e6);
+	}
+	fprintf(stderr, "  %-22s %14.3f\n", "total (wall)", (monotonicNs() - startNs) / 1e6);
+}
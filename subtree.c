@@ -0,0 +1,158 @@
+/*
+ * Subtree totals for --du under -R.
+ * The totals of a directory start with its own inode, get the entries it
+ * lists added once it is printed and the totals of each subdirectory once
+ * that subtree is printed, so they are complete, bottom-up, right after
+ * the last directory of the subtree; no second pass over the tree.
+ * As du does, a file with more than one link is counted once, at its
+ * first name. Only what the listing reads is counted: hidden files are
+ * left out unless -a or -A is given, and files the predicates of
+ * filter.c drop are left out as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "ls.h"
+
+#define LINK_SET_MIN 1024
+
+struct linkkey {
+	dev_t dev;
+	ino_t ino;
+};
+
+int duMode;
+
+// (dev, ino) of the multiply linked files seen, open addressing
+static struct linkkey *linkSet;
+static size_t linkSetSize;
+static size_t linkCount;
+
+static size_t 
+linkHash(dev_t dev, ino_t ino)
+{
+	unsigned long long h;
+
+	h = (unsigned long long) ino * 0x9e3779b97f4a7c15ULL ^ (unsigned long long) dev;
+	return (h ^ (h >> 29)) & (linkSetSize - 1);
+}
+
+static void 
+insertLink(dev_t dev, ino_t ino)
+{
+	size_t i;
+
+	i = linkHash(dev, ino);
+	while (linkSet[i].ino != 0) {
+		i = (i + 1) & (linkSetSize - 1);
+	}
+	linkSet[i].dev = dev;
+	linkSet[i].ino = ino;
+}
+
+// returns 1 the first time the file is seen
+static int 
+firstLink(struct stat *sb)
+{
+	struct linkkey *old;
+	size_t i, oldSize;
+
+	if (linkCount * 2 >= linkSetSize) {
+		old = linkSet;
+		oldSize = linkSetSize;
+		linkSetSize = (oldSize == 0) ? LINK_SET_MIN : oldSize * 2;
+		if ((linkSet = calloc(linkSetSize, sizeof(struct linkkey))) == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+		for (i = 0; i < oldSize; i++) {
+			if (old[i].ino != 0) {
+				insertLink(old[i].dev, old[i].ino);
+			}
+		}
+		free(old);
+	}
+
+	i = linkHash(sb->st_dev, sb->st_ino);
+	while (linkSet[i].ino != 0) {
+		if (linkSet[i].ino == sb->st_ino && linkSet[i].dev == sb->st_dev) {
+			return 0;
+		}
+		i = (i + 1) & (linkSetSize - 1);
+	}
+	linkSet[i].dev = sb->st_dev;
+	linkSet[i].ino = sb->st_ino;
+	linkCount++;
+
+	return 1;
+}
+
+// totals of a directory with only its own inode in them yet
+void 
+startSubtree(struct subtree *t, struct stat *sb)
+{
+	memset(t, 0, sizeof(struct subtree));
+	t->blocks = sb->st_blocks;
+	t->size = sb->st_size;
+	t->dirs = 1;
+}
+
+// add the files of list to t; returns the started totals of its
+// subdirectories in the order they are walked (NULL if there are none),
+// to be added with addSubtree() once each is done
+struct subtree *
+countEntries(struct subtree *t, struct entrylist *list)
+{
+	struct subtree *children;
+	struct entry *e;
+	int i, n;
+
+	n = 0;
+	for (i = 0; i < list->count + list->walkOnly; i++) {
+		e = &list->entries[i];
+		if (S_ISDIR(e->sb->st_mode)) {
+			if (strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0) {
+				n++;
+			}
+			continue;
+		}
+
+		if (e->sb->st_nlink > 1 && !firstLink(e->sb)) {
+			continue;
+		}
+		t->blocks += e->sb->st_blocks;
+		t->size += e->sb->st_size;
+		t->files++;
+	}
+
+	if (n == 0) {
+		return NULL;
+	}
+
+	if ((children = malloc(n * sizeof(struct subtree))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	n = 0;
+	for (i = 0; i < list->count + list->walkOnly; i++) {
+		e = &list->entries[i];
+		if (S_ISDIR(e->sb->st_mode) && strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0) {
+			startSubtree(&children[n++], e->sb);
+		}
+	}
+
+	return children;
+}
+
+void 
+addSubtree(struct subtree *t, struct subtree *child)
+{
+	t->blocks += child->blocks;
+	t->size += child->size;
+	t->files += child->files;
+	t->dirs += child->dirs;
+}
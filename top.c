@@ -0,0 +1,215 @@
+/*
+ * --top N: list only the first N entries in listing order, the N largest
+ * under -S or the N newest under -t.
+ * The N entries are kept in a heap whose root is the one listed last, so
+ * every other entry costs one comparison against the root and, if it is
+ * listed before, log N to replace it; only the N are sorted and
+ * formatted.
+ * Without -R this is done per directory. Under -R the whole walk feeds one
+ * heap and nothing is printed until it is done: then the N entries are
+ * listed with their paths, as file operands are. The heap holds copies of
+ * the N paths and stats, so memory stays in proportion to N whatever the
+ * size of the tree. --du is ignored: there are no subtree lines.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ls.h"
+
+int topCount;
+
+// the entries kept across -R, with their stats; top.entries[i].sb points
+// into topStats and path is a copy, name its last component
+static struct entrylist top;
+static struct stat *topStats;
+
+static void 
+swapEntries(struct entry *a, struct entry *b)
+{
+	struct entry t;
+
+	t = *a;
+	*a = *b;
+	*b = t;
+}
+
+// compareEntries() with ties, which under -R can be entries of the same
+// name in different directories, broken on the full path; a and b are
+// entries of the same directory or both kept entries
+static int 
+compareTop(struct entry *a, struct entry *b)
+{
+	int ret;
+
+	if ((ret = compareEntries(a, b)) != 0 || sortFlag == FLAG_f) {
+		return ret;
+	}
+
+	ret = strcmp(a->path, b->path);
+	return (flagr == 1) ? -ret : ret;
+}
+
+static int 
+compareTopQsort(const void *p1, const void *p2)
+{
+	return compareTop((struct entry *) p1, (struct entry *) p2);
+}
+
+// compareTop() of e, an entry of the directory e->path, and a kept entry
+static int 
+compareOffered(struct entry *e, struct entry *kept)
+{
+	char *path;
+	int ret;
+
+	if ((ret = compareEntries(e, kept)) != 0 || sortFlag == FLAG_f) {
+		return ret;
+	}
+
+	path = joinPath(e->path, e->name);
+	ret = strcmp(path, kept->path);
+	free(path);
+	return (flagr == 1) ? -ret : ret;
+}
+
+// restore the heap below i: every entry is listed after its children
+static void 
+siftDown(struct entry *heap, int n, int i)
+{
+	int child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && compareTop(&heap[child + 1], &heap[child]) > 0) {
+			child++;
+		}
+		if (compareTop(&heap[child], &heap[i]) <= 0) {
+			break;
+		}
+		swapEntries(&heap[child], &heap[i]);
+		i = child;
+	}
+}
+
+static void 
+siftUp(struct entry *heap, int i)
+{
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (compareTop(&heap[i], &heap[parent]) <= 0) {
+			break;
+		}
+		swapEntries(&heap[i], &heap[parent]);
+		i = parent;
+	}
+}
+
+// keep the first topCount entries of list in listing order, unsorted, at
+// its front; the rest is dropped
+void 
+selectTop(struct entrylist *list)
+{
+	int i, n, phase;
+
+	if (list->count <= topCount) {
+		return;
+	}
+
+	phase = enterPhase(PHASE_SORT);
+	n = topCount;
+	for (i = 1; i < n; i++) {
+		siftUp(list->entries, i);
+	}
+
+	for (i = n; i < list->count; i++) {
+		if (compareTop(&list->entries[i], &list->entries[0]) < 0) {
+			list->entries[0] = list->entries[i];
+			siftDown(list->entries, n, 0);
+		}
+	}
+	list->count = n;
+	enterPhase(phase);
+}
+
+// copy e, an entry of the directory listed at e->path, into slot i
+static void 
+keepEntry(int i, struct entry *e)
+{
+	struct entry *t;
+	char *path;
+
+	t = &top.entries[i];
+	free(t->path);
+	path = joinPath(e->path, e->name);
+	t->path = path;
+	t->name = path + strlen(path) - strlen(e->name);
+	t->type = e->type;
+	*t->sb = *e->sb;
+}
+
+// offer the entries of a directory listed under -R to the heap
+void 
+offerTop(struct entrylist *list)
+{
+	struct entry *e;
+	int i, phase;
+
+	if (topStats == NULL) {
+		if ((top.entries = calloc(topCount, sizeof(struct entry))) == NULL ||
+		    (topStats = malloc(topCount * sizeof(struct stat))) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		top.size = topCount;
+		for (i = 0; i < topCount; i++) {
+			top.entries[i].sb = &topStats[i];
+		}
+	}
+
+	phase = enterPhase(PHASE_SORT);
+	for (i = 0; i < list->count; i++) {
+		e = &list->entries[i];
+		if (strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) {
+			continue;
+		}
+
+		if (top.count < topCount) {
+			keepEntry(top.count, e);
+			siftUp(top.entries, top.count++);
+		} else if (compareOffered(e, &top.entries[0]) < 0) {
+			keepEntry(0, e);
+			siftDown(top.entries, top.count, 0);
+		}
+	}
+	enterPhase(phase);
+}
+
+// list the entries kept across -R
+void 
+printTop()
+{
+	int i, phase;
+
+	if (top.count == 0) {
+		return;
+	}
+
+	// sortEntries() would break ties on the name only
+	if (sortFlag != FLAG_f) {
+		phase = enterPhase(PHASE_SORT);
+		qsort(top.entries, top.count, sizeof(struct entry), compareTopQsort);
+		enterPhase(phase);
+	}
+	printFileEntries(&top);
+
+	for (i = 0; i < top.count; i++) {
+		free(top.entries[i].path);
+	}
+	free(top.entries);
+	free(topStats);
+	initEntryList(&top);
+	topStats = NULL;
+}
@@ -0,0 +1,350 @@
+/*
+ * io_uring backend for stat'ing a whole directory.
+ * statx requests for the entries of a directory are submitted in batches
+ * through one ring per thread, keeping up to URING_DEPTH lookups in flight,
+ * and completions are collected as they arrive. This overlaps the lookup
+ * latency of the entries on network and FUSE filesystems and saves one
+ * syscall per entry. When io_uring is not available (old kernel, seccomp,
+ * io_uring_disabled) or LS_NO_URING is set, callers use the synchronous
+ * path in meta.c. A ring that fails later, or a kernel without
+ * IORING_OP_STATX, turns io_uring off for the rest of the process and the
+ * batch at hand is finished synchronously.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "ls.h"
+
+#define URING_DEPTH 256
+
+struct uring {
+	int fd;
+
+	unsigned int *sqHead;
+	unsigned int *sqTail;
+	unsigned int *sqMask;
+	unsigned int *sqArray;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cqHead;
+	unsigned int *cqTail;
+	unsigned int *cqMask;
+	struct io_uring_cqe *cqes;
+
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;
+	size_t cqRingSize;
+	size_t sqesSize;
+
+	struct statx stx[URING_DEPTH];
+	int slotEntry[URING_DEPTH];	// entry index of a slot in flight
+	int freeSlots[URING_DEPTH];
+	int freeCount;
+
+	struct uring *nextDropped;
+};
+
+static __thread struct uring *ring;
+static __thread int ringFailed;
+// -1 until LS_NO_URING is read, 1 once io_uring turned out unusable in any
+// thread; set from the workers, so it is only accessed atomically
+static int uringDisabled = -1;
+// rings given up with requests possibly in flight, which may still complete
+// into them
+static struct uring *droppedRings;
+
+static int 
+setupRing(struct uring *r)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	int i;
+
+	memset(&p, 0, sizeof(p));
+	if ((r->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p)) == -1) {
+		return -1;
+	}
+
+	r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cqRingSize > r->sqRingSize) {
+			r->sqRingSize = r->cqRingSize;
+		}
+		r->cqRingSize = r->sqRingSize;
+	}
+
+	r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+	    r->fd, IORING_OFF_SQ_RING);
+	if (r->sqRing == MAP_FAILED) {
+		close(r->fd);
+		return -1;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cqRing = r->sqRing;
+	} else {
+		r->cqRing = mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+		    r->fd, IORING_OFF_CQ_RING);
+		if (r->cqRing == MAP_FAILED) {
+			munmap(r->sqRing, r->sqRingSize);
+			close(r->fd);
+			return -1;
+		}
+	}
+
+	r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+	    r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		if (r->cqRing != r->sqRing) {
+			munmap(r->cqRing, r->cqRingSize);
+		}
+		munmap(r->sqRing, r->sqRingSize);
+		close(r->fd);
+		return -1;
+	}
+
+	sq = r->sqRing;
+	r->sqHead = (unsigned int *) (sq + p.sq_off.head);
+	r->sqTail = (unsigned int *) (sq + p.sq_off.tail);
+	r->sqMask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	r->sqArray = (unsigned int *) (sq + p.sq_off.array);
+
+	cq = r->cqRing;
+	r->cqHead = (unsigned int *) (cq + p.cq_off.head);
+	r->cqTail = (unsigned int *) (cq + p.cq_off.tail);
+	r->cqMask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	for (i = 0; i < URING_DEPTH; i++) {
+		r->freeSlots[i] = i;
+	}
+	r->freeCount = URING_DEPTH;
+
+	return 0;
+}
+
+static struct uring *
+getRing()
+{
+	char *env;
+	int disabled;
+
+	if ((disabled = __atomic_load_n(&uringDisabled, __ATOMIC_RELAXED)) == -1) {
+		env = getenv("LS_NO_URING");
+		disabled = (env != NULL && *env != '\0');
+		__atomic_store_n(&uringDisabled, disabled, __ATOMIC_RELAXED);
+	}
+
+	if (disabled) {
+		return NULL;
+	}
+	if (ring != NULL || ringFailed) {
+		return ring;
+	}
+
+	if ((ring = calloc(1, sizeof(struct uring))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	if (setupRing(ring) == -1) {
+		free(ring);
+		ring = NULL;
+		ringFailed = 1;
+	}
+
+	return ring;
+}
+
+static void 
+disableUring()
+{
+	__atomic_store_n(&uringDisabled, 1, __ATOMIC_RELAXED);
+}
+
+// called by threads that stat'ed through the ring before they exit
+void 
+freeRing()
+{
+	if (ring == NULL) {
+		return;
+	}
+
+	munmap(ring->sqes, ring->sqesSize);
+	if (ring->cqRing != ring->sqRing) {
+		munmap(ring->cqRing, ring->cqRingSize);
+	}
+	munmap(ring->sqRing, ring->sqRingSize);
+	close(ring->fd);
+	free(ring);
+	ring = NULL;
+}
+
+static void 
+queueStatx(struct uring *r, int dirfd, struct entry *e, int index)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+	int slot;
+
+	slot = r->freeSlots[--r->freeCount];
+	r->slotEntry[slot] = index;
+
+	tail = *r->sqTail;
+	sqe = &r->sqes[tail & *r->sqMask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (unsigned long) e->name;
+	sqe->len = metaStatxMask();
+	sqe->off = (unsigned long) &r->stx[slot];
+	sqe->statx_flags = metaStatxFlags();
+	sqe->user_data = slot;
+
+	r->sqArray[tail & *r->sqMask] = tail & *r->sqMask;
+	__atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+	countStat(STAT_URING_STATX, 1);
+}
+
+// returns the number of completions reaped
+static int 
+reapCompletions(struct uring *r, int dirfd, struct entry *entries)
+{
+	struct io_uring_cqe *cqe;
+	struct entry *e;
+	unsigned int head;
+	int slot, n;
+
+	n = 0;
+	head = *r->cqHead;
+	while (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+		cqe = &r->cqes[head & *r->cqMask];
+		slot = cqe->user_data;
+		e = &entries[r->slotEntry[slot]];
+
+		// failures are retried synchronously; an entry that vanished is
+		// listed with an empty stat. EINVAL means the kernel has no
+		// IORING_OP_STATX, so the ring is not used again
+		if (cqe->res >= 0) {
+			statxToStat(&r->stx[slot], e->sb);
+		} else {
+			if (cqe->res == -EINVAL) {
+				disableUring();
+			}
+			if (fetchMeta(dirfd, e->name, e->sb) == -1) {
+				memset(e->sb, 0, sizeof(struct stat));
+			}
+		}
+
+		r->freeSlots[r->freeCount++] = slot;
+		head++;
+		n++;
+	}
+	__atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+// give up the ring of this thread after io_uring_enter failed: the entries
+// still in flight are stat'ed synchronously. Their requests may yet complete
+// into r, so it is kept on droppedRings instead of being freed
+static void 
+dropRing(struct uring *r, int dirfd, struct entry *entries)
+{
+	char inFlight[URING_DEPTH];
+	struct entry *e;
+	int slot;
+
+	reapCompletions(r, dirfd, entries);
+
+	memset(inFlight, 1, sizeof(inFlight));
+	for (slot = 0; slot < r->freeCount; slot++) {
+		inFlight[r->freeSlots[slot]] = 0;
+	}
+	for (slot = 0; slot < URING_DEPTH; slot++) {
+		if (inFlight[slot]) {
+			e = &entries[r->slotEntry[slot]];
+			if (fetchMeta(dirfd, e->name, e->sb) == -1) {
+				memset(e->sb, 0, sizeof(struct stat));
+			}
+		}
+	}
+
+	munmap(r->sqes, r->sqesSize);
+	if (r->cqRing != r->sqRing) {
+		munmap(r->cqRing, r->cqRingSize);
+	}
+	munmap(r->sqRing, r->sqRingSize);
+	close(r->fd);
+	r->nextDropped = __atomic_load_n(&droppedRings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&droppedRings, &r->nextDropped, r, 0, 
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+	ring = NULL;
+	ringFailed = 1;
+	disableUring();
+}
+
+// stat the entries of the directory open as dirfd that need it, keeping up
+// to URING_DEPTH requests in flight
+// returns how many entries, from the first, were done; the caller stats the
+// rest (all of them if io_uring can not be used) synchronously
+int 
+uringStatEntries(int dirfd, struct entry *entries, int count)
+{
+	struct uring *r;
+	unsigned int pending;
+	int i, inFlight;
+
+	if ((r = getRing()) == NULL) {
+		return 0;
+	}
+
+	i = 0;
+	inFlight = 0;
+	while (i < count || inFlight > 0) {
+		while (i < count && r->freeCount > 0 && 
+		    __atomic_load_n(&uringDisabled, __ATOMIC_RELAXED) == 0) {
+			if (needStat(entries[i].type)) {
+				queueStatx(r, dirfd, &entries[i], i);
+				inFlight++;
+			} else {
+				fillTypeStat(entries[i].sb, entries[i].type);
+			}
+			i++;
+		}
+
+		if (inFlight == 0) {
+			break;
+		}
+
+		// requests not consumed by an interrupted call stay in the ring;
+		// any other error (EBUSY, ENOMEM, EPERM...) ends io_uring for the
+		// process
+		pending = *r->sqTail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE);
+		countStat(STAT_URING_ENTER, 1);
+		if (syscall(__NR_io_uring_enter, r->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && 
+		    errno != EINTR) {
+			dropRing(r, dirfd, entries);
+			return i;
+		}
+
+		inFlight -= reapCompletions(r, dirfd, entries);
+	}
+
+	return i;
+}
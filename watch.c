@@ -0,0 +1,343 @@
+/*
+ * --watch: after the listing, follow changes with inotify.
+ * Every directory listed (every directory of the walk under -R) is
+ * watched from the moment it is printed. Events are gathered for
+ * WATCH_SETTLE_MS after the first one of a batch and merged per entry,
+ * then only the entries they name are stat'ed again and printed, as file
+ * operands would be:
+ *   + entry   created or moved in
+ *   ~ entry   changed (contents or attributes)
+ *   - path    removed or moved out
+ * In the record formats the marks are left out and a removed entry is a
+ * record with an empty stat (mode 0). Under -R, directories created or
+ * moved in later are watched as well, with their subdirectories. When the
+ * event queue overflows, the events lost are unknown, so every watched
+ * directory is listed again in full. Watching ends when no watched
+ * directory is left.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#include "ls.h"
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+	IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+	IN_ONLYDIR | IN_EXCL_UNLINK)
+
+// how long to wait for more events once one has come in
+#define WATCH_SETTLE_MS 100
+
+#define WATCH_BUF_SIZE (64 * 1024)
+
+// one entry named by the events of a batch
+struct change {
+	int wd;
+	char *name;
+	unsigned int mask;	// all events for it, or'ed
+};
+
+int watchMode;
+
+static int inotifyFd = -1;
+static int watchRecursive;
+static char **dirs;	// path by watch descriptor, NULL if it is gone
+static int dirsSize;
+static int watchCount;
+static int warned;
+static int overflowed;	// events were lost since the last batch
+
+static struct change *changes;
+static int changeCount;
+static int changeSize;
+
+void 
+initWatch(int recursive)
+{
+	if ((inotifyFd = inotify_init1(IN_CLOEXEC)) == -1) {
+		perror("inotify_init1");
+		exit(1);
+	}
+	watchRecursive = recursive;
+}
+
+// watch the listed directory path; no-op unless --watch is on
+void 
+watchDirectory(const char *path)
+{
+	int wd;
+
+	if (inotifyFd == -1) {
+		return;
+	}
+
+	if ((wd = inotify_add_watch(inotifyFd, path, WATCH_EVENTS)) == -1) {
+		// most likely out of watches (fs.inotify.max_user_watches)
+		if (!warned) {
+			fprintf(stderr, "%s: %s: cannot watch: %s\n", progname, path, strerror(errno));
+			warned = 1;
+		}
+		return;
+	}
+
+	if (wd >= dirsSize) {
+		dirsSize = (wd < 64) ? 64 : wd * 2;
+		if ((dirs = realloc(dirs, dirsSize * sizeof(char *))) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	// the same directory listed twice gets the same watch descriptor
+	if (wd < watchCount && dirs[wd] != NULL) {
+		return;
+	}
+	while (watchCount <= wd) {
+		dirs[watchCount++] = NULL;
+	}
+	if ((dirs[wd] = strdup(path)) == NULL) {
+		perror("strdup");
+		exit(1);
+	}
+}
+
+static int 
+liveWatches()
+{
+	int i, n;
+
+	n = 0;
+	for (i = 0; i < watchCount; i++) {
+		if (dirs[i] != NULL) {
+			n++;
+		}
+	}
+
+	return n;
+}
+
+static void 
+addChange(int wd, const char *name, unsigned int mask)
+{
+	int i;
+
+	for (i = 0; i < changeCount; i++) {
+		if (changes[i].wd == wd && strcmp(changes[i].name, name) == 0) {
+			changes[i].mask |= mask;
+			return;
+		}
+	}
+
+	if (changeCount == changeSize) {
+		changeSize = (changeSize == 0) ? 64 : changeSize * 2;
+		if ((changes = realloc(changes, changeSize * sizeof(struct change))) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	changes[changeCount].wd = wd;
+	changes[changeCount].mask = mask;
+	if ((changes[changeCount].name = strdup(name)) == NULL) {
+		perror("strdup");
+		exit(1);
+	}
+	changeCount++;
+}
+
+// read the pending events into changes
+static void 
+readEvents(char *buf)
+{
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	if ((n = read(inotifyFd, buf, WATCH_BUF_SIZE)) == -1) {
+		if (errno == EINTR) {
+			return;
+		}
+		perror("read");
+		exit(1);
+	}
+
+	for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+		ev = (struct inotify_event *) p;
+		if (ev->mask & IN_Q_OVERFLOW) {
+			overflowed = 1;
+			continue;
+		}
+		if (ev->wd < 0 || ev->wd >= watchCount || dirs[ev->wd] == NULL) {
+			continue;
+		}
+
+		if (ev->mask & IN_IGNORED) {
+			// the directory is gone, or was unmounted; its path is
+			// dropped after the changes before this one are reported
+			addChange(ev->wd, "", IN_IGNORED);
+			continue;
+		}
+
+		if (ev->mask & IN_MOVE_SELF) {
+			// its path is stale now; IN_IGNORED follows
+			inotify_rm_watch(inotifyFd, ev->wd);
+			continue;
+		}
+
+		if (ev->len == 0 || !filterName(ev->name, DT_UNKNOWN)) {
+			continue;
+		}
+
+		addChange(ev->wd, ev->name, ev->mask);
+	}
+}
+
+// watch path and, below it, every directory the walk of -R would enter
+static void 
+watchTree(char *path)
+{
+	struct dirent *d;
+	struct stat sb;
+	char *child;
+	DIR *dir;
+
+	watchDirectory(path);
+	if ((dir = opendir(path)) == NULL) {
+		return;
+	}
+
+	while ((d = readdir(dir)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0 || 
+		    (d->d_type != DT_DIR && d->d_type != DT_UNKNOWN) || !filterName(d->d_name, DT_DIR)) {
+			continue;
+		}
+
+		child = joinPath(path, d->d_name);
+		if (d->d_type == DT_DIR || (fetchMeta(AT_FDCWD, child, &sb) == 0 && S_ISDIR(sb.st_mode))) {
+			watchTree(child);
+		}
+		free(child);
+	}
+	closedir(dir);
+}
+
+static void 
+reportChange(struct change *c)
+{
+	struct entry e;
+	struct stat sb;
+	char *path;
+	char mark;
+
+	if (c->mask & IN_IGNORED) {
+		free(dirs[c->wd]);
+		dirs[c->wd] = NULL;
+		return;
+	}
+
+	path = joinPath(dirs[c->wd], c->name);
+	e.name = c->name;
+	e.path = path;
+	e.sb = &sb;
+	e.type = DT_UNKNOWN;
+
+	if (fetchMeta(AT_FDCWD, path, &sb) == -1) {
+		memset(&sb, 0, sizeof(sb));
+		mark = '-';
+	} else if (c->mask & (IN_CREATE | IN_MOVED_TO)) {
+		mark = '+';
+	} else {
+		mark = '~';
+	}
+
+	// new directories are walked whether or not they are listed
+	if (mark == '+' && watchRecursive && S_ISDIR(sb.st_mode)) {
+		watchTree(path);
+	}
+
+	if (mark == '-' || filterEntry(&e)) {
+		printChange(&e, mark);
+	}
+	free(path);
+}
+
+// list every watched directory again after events were lost; one that
+// can not be opened any more is no longer watched
+static void 
+relistWatched()
+{
+	int wd;
+
+	// watchCount grows as -R finds new directories, which are listed too
+	for (wd = 0; wd < watchCount; wd++) {
+		if (dirs[wd] != NULL && relistDirectory(dirs[wd]) == -1) {
+			inotify_rm_watch(inotifyFd, wd);
+			free(dirs[wd]);
+			dirs[wd] = NULL;
+		}
+	}
+	printTop();
+	overflowed = 0;
+}
+
+// follow the watched directories until none is left
+void 
+runWatch()
+{
+	struct pollfd pfd;
+	char *buf;
+	int i;
+
+	if (inotifyFd == -1) {
+		return;
+	}
+
+	if ((buf = malloc(WATCH_BUF_SIZE)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	pfd.fd = inotifyFd;
+	pfd.events = POLLIN;
+	flushOutput();
+	while (liveWatches() > 0) {
+		// block for the first event, then let the batch settle
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			exit(1);
+		}
+		readEvents(buf);
+		while (poll(&pfd, 1, WATCH_SETTLE_MS) > 0) {
+			readEvents(buf);
+		}
+
+		// after an overflow the listing again covers the changes read
+		for (i = 0; i < changeCount; i++) {
+			if (!overflowed || (changes[i].mask & IN_IGNORED)) {
+				reportChange(&changes[i]);
+			}
+			free(changes[i].name);
+		}
+		changeCount = 0;
+		if (overflowed) {
+			relistWatched();
+		}
+
+		resetArena();
+		flushOutput();
+	}
+
+	free(buf);
+	close(inotifyFd);
+	inotifyFd = -1;
+}